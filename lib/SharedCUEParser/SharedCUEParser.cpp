@@ -31,6 +31,7 @@ extern SdFs SD;
 
 FsFile * SharedCUEParser::_current_cue_file = nullptr;
 char SharedCUEParser::_shared_cuesheet[MAX_SHARED_CUE_SHEET_SIZE];
+SharedCUEParser::cue_file_id_t SharedCUEParser::_shared_cue_id = {false, 0, 0, 0, 0};
 
 static void write_default_cuesheet(char * cue_sheet)
 {
@@ -87,6 +88,7 @@ void SharedCUEParser::load_updated_cue()
 
 void SharedCUEParser::load_cue()
 {
+    _shared_cue_id = get_file_id(&_cue_file);
     if (!_cue_file.isOpen())
     {
         write_default_cuesheet(_shared_cuesheet);
@@ -101,6 +103,7 @@ void SharedCUEParser::load_cue()
         if (count <= 0)
         {
             _cue_file.close();
+            _shared_cue_id.valid = false;
         }
         else
         {
@@ -110,12 +113,35 @@ void SharedCUEParser::load_cue()
     }
 }
 
+SharedCUEParser::cue_file_id_t SharedCUEParser::get_file_id(FsFile *file)
+{
+    cue_file_id_t id = {false, 0, 0, 0, 0};
+    if (file->isOpen())
+    {
+        id.first_sector = file->firstSector();
+        id.size = file->fileSize();
+        id.valid = file->getModifyDateTime(&id.modify_date, &id.modify_time);
+    }
+    return id;
+}
+
 void SharedCUEParser::switch_cue()
 {
     if ( _current_cue_file != &_cue_file)
     {
         _current_cue_file = &_cue_file;
-        load_cue();
+
+        // The CD-ROM device and the image browser often have the same cue file open,
+        // reload only if this parser's file is different from what is in the buffer.
+        cue_file_id_t id = get_file_id(&_cue_file);
+        if (!id.valid || !_shared_cue_id.valid ||
+            id.first_sector != _shared_cue_id.first_sector ||
+            id.size != _shared_cue_id.size ||
+            id.modify_date != _shared_cue_id.modify_date ||
+            id.modify_time != _shared_cue_id.modify_time)
+        {
+            load_cue();
+        }
     }
 }
 
@@ -70,4 +70,18 @@ protected:
     static FsFile *_current_cue_file;
     FsFile _cue_file;
 
+    // Identifies the file loaded into _shared_cuesheet, so that parsers
+    // that have the same cue file open can switch without reading it again.
+    // The modification time catches edits that keep the file size.
+    struct cue_file_id_t
+    {
+        bool valid;
+        uint32_t first_sector;
+        uint64_t size;
+        uint16_t modify_date;
+        uint16_t modify_time;
+    };
+    static cue_file_id_t get_file_id(FsFile *file);
+    static cue_file_id_t _shared_cue_id;
+
 };
\ No newline at end of file
@@ -209,6 +209,9 @@ Image::ImageType Image::InferImageTypeFromExtension(const char * filename)
       if (strncasecmp(filename + len - 4, ".iso", sizeof(".iso")) == 0) {
         return Image::ImageType::cdrom;
       }
+      if (strncasecmp(filename + len - 4, ".cso", sizeof(".cso")) == 0) {
+        return Image::ImageType::cdrom;
+      }
   }
   return Image::ImageType::unknown;
 }
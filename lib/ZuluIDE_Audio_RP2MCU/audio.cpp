@@ -28,13 +28,14 @@
 #include <hardware/irq.h>
 #include <pico/multicore.h>
 #include "audio.h"
-#include <scp/SharedCUEParser.h>
+#include "audio_scale.h"
 #include <ZuluIDE_audio.h>
 #include <ZuluIDE_config.h>
 #include <ZuluIDE_platform_gpio.h>
 #include <ZuluIDE_log.h>
 #include <ZuluIDE_platform.h>
 #include <ide_imagefile.h>
+#include <ide_cdrom_tracks.h>
 #include "ZuluI2S.h"
 
 
@@ -43,45 +44,80 @@ extern SdFs SD;
 I2S i2s;
 
 static FsFile audio_parent;
-static FsFile audio_file;
-static SharedCUEParser g_cue_parser;
+// With multiple bin files, the next track is opened in the other file
+// while the current one is still playing.
+static FsFile audio_files[2];
+// Track layout of the loaded image, shared read-only with the CD-ROM device
+static const cdrom_track_table_t *g_tracks = nullptr;
 // True is using the same filenames for the bin/cue, false if using a directory with multiple bin/wav files
 static bool single_bin_file = false;
 // DMA configuration info
 static dma_channel_config snd_dma_a_cfg;
 static dma_channel_config snd_dma_b_cfg;
 
-// some chonky buffers to store audio samples,
-// output and sample buffers are the same memory
+// Ring of sample buffers, played in order by the two DMA channels.
+// Output and sample buffers are the same memory.
 #define AUDIO_OUT_BUFFER_SIZE (AUDIO_BUFFER_SIZE / 4)
-static uint32_t out_len_a = AUDIO_OUT_BUFFER_SIZE;
-static uint32_t out_len_b = AUDIO_OUT_BUFFER_SIZE;
-static uint32_t * out_len = &out_len_a;
-static uint32_t output_buf_a[AUDIO_OUT_BUFFER_SIZE];
-static uint32_t output_buf_b[AUDIO_OUT_BUFFER_SIZE];
+static uint32_t output_buf[AUDIO_BUFFER_COUNT][AUDIO_OUT_BUFFER_SIZE];
+static uint32_t out_len[AUDIO_BUFFER_COUNT];
 
-static uint8_t *sample_buf_a = (uint8_t*) output_buf_a;
-static uint8_t *sample_buf_b = (uint8_t*) output_buf_b;
+// Played by DMA when the next buffer in the ring is not ready
+#define AUDIO_SILENCE_BUFFER_SIZE 128
+#define AUDIO_BUF_SILENCE 0xFF
+static uint32_t silence_buf[AUDIO_SILENCE_BUFFER_SIZE];
+
+// Playback time of one full sample buffer at 44100 Hz 16-bit stereo
+#define AUDIO_BUFFER_US ((uint32_t)((uint64_t)AUDIO_BUFFER_SIZE * 1000000 / (44100 * 4)))
 
 // tracking for the state of the above buffers
 enum bufstate { STALE, FILLING, PROCESSING, READY };
-static volatile bufstate sbufst_a = STALE;
-static volatile bufstate sbufst_b = STALE;
-enum bufselect { A, B };
-static bufselect sbufsel = A;
-
+static volatile bufstate sbufst[AUDIO_BUFFER_COUNT];
+// micros() when the buffer was released by DMA, for refill latency statistics
+static volatile uint32_t stale_us[AUDIO_BUFFER_COUNT];
+// Next buffer to be filled from SD card and next buffer to be given to DMA
+static uint8_t fill_idx;
+static volatile uint8_t play_idx;
+// Buffer index currently configured to each DMA channel, or AUDIO_BUF_SILENCE
+static volatile uint8_t dma_buf_a;
+static volatile uint8_t dma_buf_b;
+// micros() when the previous DMA hand-off happened
+static volatile uint32_t play_start_us;
+
+// Image transfers in progress, see audio_transfer_begin()
+static uint8_t transfer_depth = 0;
+
+// Sample buffer statistics
+static struct {
+    volatile uint32_t underruns;
+    volatile bool in_underrun;
+    uint32_t refills;
+    uint32_t transfer_refills;
+    uint32_t latency_max_us;
+    uint64_t latency_total_us;
+} audio_stats;
 
 // tracking for audio playback
 static bool audio_idle = true;
 static bool audio_playing = false;
 static volatile bool audio_paused = false;
-static uint64_t fpos;
-static uint32_t fleft;
-static uint64_t gap_length = 0;
-static bool last_track_reached = false;
-static bool within_gap = false;
-static uint32_t gap_read = 0;
-static CUETrackInfo current_track = {0};
+
+// Position within the playback range
+struct playback_state_t {
+    FsFile *file;
+    uint64_t fpos;
+    uint32_t fleft;
+    uint64_t gap_length;
+    bool last_track_reached;
+    bool within_gap;
+    uint32_t gap_read;
+    CUETrackInfo track;
+};
+static playback_state_t playback = {&audio_files[0]};
+
+// Next track, prepared while the current one is playing
+enum preload_status { PRELOAD_NONE, PRELOAD_READY, PRELOAD_FAILED };
+static playback_state_t next_playback;
+static preload_status next_status = PRELOAD_NONE;
 
 // historical playback status information
 static audio_status_code audio_last_status = ASC_NO_STATUS;
@@ -90,56 +126,46 @@ static volatile uint8_t volume[2] = {DEFAULT_VOLUME_LEVEL, DEFAULT_VOLUME_LEVEL}
 static uint8_t max_volume = 100;
 static volatile uint16_t channel = AUDIO_CHANNEL_ENABLE_MASK;
 
+// Scale for left and right channel, combining volume, max_volume and channel mute
+static volatile uint32_t scale[2] = {AUDIO_SCALE_UNITY, AUDIO_SCALE_UNITY};
+
 // mechanism for cleanly stopping DMA units
 static volatile bool audio_stopping = false;
 
 /*
- * I2S format is directly compatible to CD 16-bit audio with left and right channels
- * The only encoding needed is adjusting the volume and muting if one of the channels
- * is disabled.
+ * Recalculates the channel scales when volume settings change.
+ * Volume 255 at max_volume 100 is unity gain.
  */
-static void snd_encode(int16_t* samples, int16_t* output_buf, uint16_t len) {
-    uint8_t vol[2] = {volume[0], volume[1]};
+static void snd_update_gain() {
     uint16_t chn = channel & AUDIO_CHANNEL_ENABLE_MASK;
-    if (!(chn >> 8))   vol[1] = 0;   // right
-    if (!(chn & 0xFF)) vol[0] = 0; // left
-    int16_t temp = 0;
-    for (uint16_t i = 0; i < len; i++ )
-    {
-        if (samples == nullptr)
-            output_buf[i] = 0;
-        else
-        {
-
-            if (i % 2 == 0)
-            {
-                temp = output_buf[i+1];
-                output_buf[i+1] = (int16_t)(((int64_t)samples[i]) * (vol[0]) * max_volume / 25500);
-            }
-            else
-                output_buf[i-1] = (int16_t)(((int64_t)temp) * (vol[1]) * max_volume / 25500);
-        }
-    }
+    scale[0] = (chn & 0xFF) ? volume[0] * max_volume : 0;
+    scale[1] = (chn >> 8) ? volume[1] * max_volume : 0;
 }
 
-// functions for passing to Core1
-static void snd_process_a() {
-    snd_encode((int16_t *)(sample_buf_a), (int16_t*)(output_buf_a), AUDIO_BUFFER_SIZE/2);
+/*
+ * I2S format is directly compatible to CD 16-bit audio with left and right channels
+ * The only encoding needed is adjusting the volume and muting if one of the channels
+ * is disabled, see audio_scale.h.
+ */
+static void snd_encode(uint32_t* buf, uint32_t words) {
+    audio_scale_words(buf, words, scale[0], scale[1]);
 }
-static void snd_process_b() {
-    snd_encode((int16_t *)sample_buf_b, (int16_t*)(output_buf_b), AUDIO_BUFFER_SIZE/2);
+
+static void snd_process(uint8_t idx) {
+    snd_encode(output_buf[idx], out_len[idx] / 4);
 }
 
 
 
 /**********************************************************************************************
- * Sets up playback via side effect for last_track_reached, within_gap, fpos and fleft, gap_read
+ * Sets up playback state for the track containing start, opening its bin file to state->file
  * \param start - start of playback in lba
  * \param length - length of playback in lba
  * \param continued - true if updating values while audio is being played
  *                  - false if setting up for the first time
+ * \param state - playback state to set up, state->file must be set by caller
  **********************************************************************************************/
-static bool setup_playback(uint32_t start, uint32_t length, bool continued)
+static bool setup_playback(uint32_t start, uint32_t length, bool continued, playback_state_t *state)
 {
     static uint32_t last_length = 0;
     static uint32_t last_start = 0;
@@ -152,88 +178,66 @@ static bool setup_playback(uint32_t start, uint32_t length, bool continued)
         last_track_number = 0;
     }
 
-    // read in the first track and report errors
-    const CUETrackInfo *find_track_info;
-
     // Init globals
-    within_gap = false;
-    last_track_reached = false;
-    gap_length = 0;
-    gap_read = 0;
+    state->within_gap = false;
+    state->last_track_reached = false;
+    state->gap_length = 0;
+    state->gap_read = 0;
 
-    uint64_t file_size = 0;
-    CUETrackInfo track_info = {0};
-    uint32_t start_of_next_track = 0;
-    int file_index = -1;
-
-    g_cue_parser.restart();
-
-    while ((find_track_info = g_cue_parser.next_track(file_size)) != nullptr )
+    if (g_tracks == nullptr || g_tracks->count == 0)
     {
+        dbgmsg("------ Audio playback - no track table");
+        return false;
+    }
 
-        if (!single_bin_file)
-        {
-            // opening the file for getting file size
-            if (find_track_info->file_index != file_index)
-            {
-                if (!(audio_parent.isDir() && audio_file.open(&audio_parent, find_track_info->filename, O_RDONLY)))
-                {
-                    dbgmsg("------ Audio playback - could not open the next track's bin file: ", find_track_info->filename);
-                    audio_file.close();
-                    return false;
-                }
-                file_index = find_track_info->file_index;
-            }
-        }
-        file_size = audio_file.size();
-
-
-        if (continued)
-        {
-            // looking the next track
-            if (find_track_info->track_number < last_track_number + 1)
-                continue;
-            if (find_track_info->track_number == last_track_number + 1)
-            {
-                // set start to the new track because the last track has finished
-                start = find_track_info->track_start;
-            }
-        }
+    int idx;
+    if (continued)
+    {
+        // Tracks are sorted, so the one after the last played track is next
+        idx = 0;
+        while (idx < g_tracks->count && g_tracks->entries[idx].track_number <= last_track_number)
+            idx++;
 
-        if (start < find_track_info->track_start)
+        if (idx >= g_tracks->count)
         {
-            // start began in the last track, stop looping
-            start_of_next_track = find_track_info->track_start;
-            break;
+            dbgmsg("------ Audio continued playback could not find specified track");
+            return false;
         }
-
-        track_info = *find_track_info;
-
+        start = g_tracks->entries[idx].track_start;
     }
-
-    if (!single_bin_file)
+    else
     {
-        if (!(audio_parent.isDir() && audio_file.open(&audio_parent, track_info.filename, O_RDONLY)))
+        idx = cdrom_track_index(g_tracks, start);
+        if (idx < 0)
         {
-            dbgmsg("------ Audio playback - could not open the current track's bin file: ", track_info.filename);
-            audio_file.close();
+            dbgmsg("------ Audio playback could not find track for lba ", (int)start);
             return false;
         }
     }
 
-    if (find_track_info == nullptr)
+    CUETrackInfo track_info = cdrom_track_info(g_tracks, idx);
+    uint32_t start_of_next_track = 0;
+    if (idx + 1 < g_tracks->count)
+    {
+        start_of_next_track = g_tracks->entries[idx + 1].track_start;
+    }
+    else
+    {
+        state->last_track_reached = true;
+    }
+
+    if (!single_bin_file)
     {
-        // if the loop completed without breaking
-        last_track_reached = true;
-        if (track_info.track_number == 0)
+        if (!(audio_parent.isDir() && state->file->open(&audio_parent, track_info.filename, O_RDONLY)))
         {
-            dbgmsg("------ Audio continued playback could not find specified track");
+            dbgmsg("------ Audio playback - could not open the current track's bin file: ", track_info.filename);
+            state->file->close();
             return false;
         }
     }
 
     // test if the current or new audio file is open or can be opened
-    if (single_bin_file && !audio_file.isOpen())
+    if (single_bin_file && !state->file->isOpen())
     {
         dbgmsg("------ Audio playback - CD's bin file is not open");
         return false;
@@ -264,10 +268,10 @@ static bool setup_playback(uint32_t start, uint32_t length, bool continued)
     else if (track_info.unstored_pregap_length != 0 && start >= track_info.data_start - track_info.unstored_pregap_length)
     {
         // Start is within the pregap position, offset is not increased due to no file data is being played
-        gap_length = (start - track_info.data_start) *(uint64_t) track_info.sector_length;
+        state->gap_length = (start - track_info.data_start) *(uint64_t) track_info.sector_length;
         // offset += 0;
-        within_gap = true;
-        gap_read = 0;
+        state->within_gap = true;
+        state->gap_read = 0;
     }
     else
     {
@@ -293,22 +297,22 @@ static bool setup_playback(uint32_t start, uint32_t length, bool continued)
         if (start + length < start_of_next_track)
         {
             // playback ends before the next track
-            if (within_gap)
+            if (state->within_gap)
                 // adjust length unplayed file data within gap
-                fleft = (length - track_info.unstored_pregap_length) * (uint64_t)track_info.sector_length;
+                state->fleft = (length - track_info.unstored_pregap_length) * (uint64_t)track_info.sector_length;
             else
-                fleft = length * (uint64_t)track_info.sector_length;
+                state->fleft = length * (uint64_t)track_info.sector_length;
 
-            last_track_reached = true;
+            state->last_track_reached = true;
         }
         else
         {
             // playback continues after this track
-            if (within_gap)
-                fleft = (start_of_next_track - track_info.data_start) * (uint64_t)track_info.sector_length;
+            if (state->within_gap)
+                state->fleft = (start_of_next_track - track_info.data_start) * (uint64_t)track_info.sector_length;
             else
-                fleft = (start_of_next_track - start) * (uint64_t)track_info.sector_length;
-            last_track_reached = false;
+                state->fleft = (start_of_next_track - start) * (uint64_t)track_info.sector_length;
+            state->last_track_reached = false;
         }
     }
     else
@@ -317,14 +321,14 @@ static bool setup_playback(uint32_t start, uint32_t length, bool continued)
         volatile uint64_t size_of_playback;
         volatile uint32_t start_lba = start;
         size_of_playback = (start_lba + length - track_info.data_start) * (uint64_t)track_info.sector_length ;
-        volatile uint64_t last_track_byte_length = audio_file.size() - track_info.file_offset;
+        volatile uint64_t last_track_byte_length = state->file->size() - track_info.file_offset;
         if (size_of_playback <= last_track_byte_length)
         {
-            if (within_gap)
-                fleft = (length - (track_info.data_start - start)) * track_info.sector_length;
+            if (state->within_gap)
+                state->fleft = (length - (track_info.data_start - start)) * track_info.sector_length;
             else
-                fleft = length *  track_info.sector_length;
-            last_track_reached = true;
+                state->fleft = length *  track_info.sector_length;
+            state->last_track_reached = true;
         }
         else
         {
@@ -332,41 +336,89 @@ static bool setup_playback(uint32_t start, uint32_t length, bool continued)
             return false;
         }
     }
-    current_track = track_info;
-    fpos = offset;
+    state->track = track_info;
+    state->fpos = offset;
     return true;
 }
 
+/**********************************************************************************************
+ * Sets up next_playback for the track following the current one, so that switching
+ * tracks during playback does not need CUE parsing, opening files or seeking.
+ **********************************************************************************************/
+static void preload_next_track()
+{
+    if (single_bin_file)
+    {
+        next_playback.file = playback.file;
+    }
+    else
+    {
+        // Open the next bin file in the file object not used by the current track
+        next_playback.file = (playback.file == &audio_files[0]) ? &audio_files[1] : &audio_files[0];
+    }
+
+    if (!setup_playback(0, 0, true, &next_playback))
+    {
+        next_status = PRELOAD_FAILED;
+        return;
+    }
+
+    if (next_playback.file != playback.file && next_playback.file->position() != next_playback.fpos)
+    {
+        next_playback.file->seek(next_playback.fpos);
+    }
+    next_status = PRELOAD_READY;
+}
+
 /* ------------------------------------------------------------------------ */
 /* ---------- VISIBLE FUNCTIONS ------------------------------------------- */
 /* ------------------------------------------------------------------------ */
+// Reconfigures a DMA channel that finished playing with the buffer that
+// follows the one now playing on the other channel.
+static void audio_dma_next(uint ch, dma_channel_config *cfg, volatile uint8_t *dma_buf)
+{
+    uint8_t done = *dma_buf;
+    if (done != AUDIO_BUF_SILENCE)
+    {
+        sbufst[done] = STALE;
+        stale_us[done] = micros();
+    }
+    play_start_us = micros();
+
+    const uint32_t *src = silence_buf;
+    uint32_t count = AUDIO_SILENCE_BUFFER_SIZE;
+    *dma_buf = AUDIO_BUF_SILENCE;
+    if (audio_stopping)
+    {
+        channel_config_set_chain_to(cfg, ch);
+    }
+    else if (!audio_paused && sbufst[play_idx] == READY)
+    {
+        src = output_buf[play_idx];
+        count = out_len[play_idx] / 4;
+        *dma_buf = play_idx;
+        play_idx = (play_idx + 1) % AUDIO_BUFFER_COUNT;
+        audio_stats.in_underrun = false;
+    }
+    else if (!audio_paused && !audio_stats.in_underrun && !(playback.last_track_reached && playback.fleft == 0))
+    {
+        // Samples were not read from SD card in time
+        audio_stats.underruns++;
+        audio_stats.in_underrun = true;
+    }
+
+    dma_channel_configure(ch, cfg, i2s.getPioFIFOAddr(), src, count, false);
+}
+
 extern "C"
 {
 static void audio_dma_irq() {
     if (dma_hw->intr & (1 << SOUND_DMA_CHA)) {
         dma_hw->ints0 = (1 << SOUND_DMA_CHA);
-        sbufst_a = STALE;
-        if (audio_stopping) {
-            channel_config_set_chain_to(&snd_dma_a_cfg, SOUND_DMA_CHA);
-        }
-        dma_channel_configure(SOUND_DMA_CHA,
-                &snd_dma_a_cfg,
-                i2s.getPioFIFOAddr(),
-                output_buf_a,
-                out_len_a / 4,
-                false);
+        audio_dma_next(SOUND_DMA_CHA, &snd_dma_a_cfg, &dma_buf_a);
     } else if (dma_hw->intr & (1 << SOUND_DMA_CHB)) {
         dma_hw->ints0 = (1 << SOUND_DMA_CHB);
-        sbufst_b = STALE;
-        if (audio_stopping) {
-            channel_config_set_chain_to(&snd_dma_b_cfg, SOUND_DMA_CHB);
-        }
-        dma_channel_configure(SOUND_DMA_CHB,
-                &snd_dma_b_cfg,
-                i2s.getPioFIFOAddr(),
-                output_buf_b,
-                out_len_b / 4,
-                false);
+        audio_dma_next(SOUND_DMA_CHB, &snd_dma_b_cfg, &dma_buf_b);
     }
 }
 }
@@ -403,134 +455,215 @@ void audio_disable()
 
 }
 
-void audio_poll() {
-
-    if (audio_idle) return;
-
-    static bool set_pause_buf = true;
-    if (audio_paused)
-    {
-        if (set_pause_buf)
+// Fills the next sample buffer in the ring if it has been played.
+// Returns true if a buffer was filled.
+static bool audio_refill()
+{
+    if (playback.last_track_reached && playback.fleft == 0) {
+        for (uint8_t i = 0; i < AUDIO_BUFFER_COUNT; i++)
         {
-            memset(output_buf_a, 0, sizeof(output_buf_a));
-            memset(output_buf_b, 0, sizeof(output_buf_b));
+            if (sbufst[i] != STALE)
+            {
+                // out of data to read but still working on remainder
+                return false;
+            }
         }
-        set_pause_buf = false;
-        return;
-    }
-    set_pause_buf = true;
-
 
-    if (last_track_reached && fleft == 0 && sbufst_a == STALE && sbufst_b == STALE) {
         // out of data and ready to stop
         audio_stop();
-        return;
-    } else if (last_track_reached && fleft == 0) {
-        // out of data to read but still working on remainder
-        return;
-    } else if (!audio_file.isOpen()) {
+        return false;
+    } else if (!playback.file->isOpen()) {
         // closed elsewhere, maybe disk ejected?
         dbgmsg("------ Playback stop due to closed file");
         audio_stop();
-        return;
+        return false;
     }
 
+    // are new audio samples needed from the memory card?
+    uint8_t idx = fill_idx;
+    if (sbufst[idx] != STALE) {
+        // no data needed this time
+        return false;
+    }
 
-    if (fleft == 0)
+    if (playback.fleft == 0)
     {
-        if (!setup_playback(0, 0, true))
+        if (next_status == PRELOAD_NONE)
+        {
+            // Not prepared in time, e.g. because of continuous image transfers
+            preload_next_track();
+        }
+
+        if (next_status != PRELOAD_READY)
         {
             dbgmsg("------ Playback stopped because of error loading next track");
             audio_stop();
-            return;
+            return false;
         }
+
+        playback = next_playback;
+        next_status = PRELOAD_NONE;
     }
 
-    if (audio_file.position() != fpos) {
+    if (playback.file->position() != playback.fpos) {
         // should be uncommon due to SCSI command restrictions on devices
         // playing audio; if this is showing up in logs a different approach
         // will be needed to avoid seek performance issues on FAT32 vols
         dbgmsg("------ Audio seek required");
-        if (!audio_file.seek(fpos)) {
-            logmsg("------ Audio error, unable to seek to ", fpos);
+        if (!playback.file->seek(playback.fpos)) {
+            logmsg("------ Audio error, unable to seek to ", playback.fpos);
         }
     }
 
-    // are new audio samples needed from the memory card?
-    uint8_t* audiobuf;
-    if (sbufst_a == STALE) {
-        sbufst_a = FILLING;
-        audiobuf = sample_buf_a;
-        out_len = &out_len_a;
-    } else if (sbufst_b == STALE) {
-        sbufst_b = FILLING;
-        audiobuf = sample_buf_b;
-        out_len = &out_len_b;
-    } else {
-        // no data needed this time
-        return;
-    }
-
+    sbufst[idx] = FILLING;
+    uint8_t *audiobuf = (uint8_t*)output_buf[idx];
 
     platform_set_sd_callback(NULL, NULL);
     uint16_t toRead = AUDIO_BUFFER_SIZE;
     uint16_t gap_to_read = AUDIO_BUFFER_SIZE;
-    if (within_gap)
+    if (playback.within_gap)
     {
-        if (gap_length < gap_to_read) gap_to_read = gap_length;
+        if (playback.gap_length - playback.gap_read < gap_to_read) gap_to_read = playback.gap_length - playback.gap_read;
         memset(audiobuf, 0, AUDIO_BUFFER_SIZE);
-        gap_read += gap_to_read;
-        *out_len = gap_to_read;
-        if (gap_read >= gap_length)
+        playback.gap_read += gap_to_read;
+        out_len[idx] = gap_to_read;
+        if (playback.gap_read >= playback.gap_length)
         {
-            within_gap = false;
-            gap_read = 0;
-            gap_length = 0;
+            playback.within_gap = false;
+            playback.gap_read = 0;
+            playback.gap_length = 0;
         }
     }
     else
     {
-        if (fleft < toRead) toRead = fleft;
+        if (playback.fleft < toRead) toRead = playback.fleft;
 
-        if (audio_file.read(audiobuf, toRead) != toRead) {
+        if (playback.file->read(audiobuf, toRead) != toRead) {
             logmsg("------ Audio sample data read error");
         }
-        *out_len = toRead;
-        fpos += toRead;
-        fleft -= toRead;
+        out_len[idx] = toRead;
+        playback.fpos += toRead;
+        playback.fleft -= toRead;
+    }
+
+    sbufst[idx] = PROCESSING;
+    snd_process(idx);
+    sbufst[idx] = READY;
+    fill_idx = (idx + 1) % AUDIO_BUFFER_COUNT;
+
+    uint32_t latency = micros() - stale_us[idx];
+    audio_stats.refills++;
+    audio_stats.latency_total_us += latency;
+    if (latency > audio_stats.latency_max_us) audio_stats.latency_max_us = latency;
+    if (transfer_depth > 0) audio_stats.transfer_refills++;
+    return true;
+}
+
+// Estimate of how long the DMA can keep playing from already filled buffers
+static uint32_t audio_queued_us()
+{
+    uint32_t ready = 0;
+    for (uint8_t i = 0; i < AUDIO_BUFFER_COUNT; i++)
+    {
+        if (sbufst[i] == READY) ready++;
+    }
+    if (ready == 0) return 0;
+
+    uint32_t elapsed = micros() - play_start_us;
+    if (elapsed > AUDIO_BUFFER_US) elapsed = AUDIO_BUFFER_US;
+    return ready * AUDIO_BUFFER_US - elapsed;
+}
+
+void audio_poll() {
+
+    if (audio_idle || audio_paused) return;
+
+    // During image transfers this may be called from within an SD card
+    // callback, refills are then done from audio_poll_transfer().
+    if (transfer_depth > 0) return;
+
+    // One buffer per call keeps the time spent here short,
+    // playing a buffer takes much longer than the polling interval.
+    if (!audio_refill() && !audio_idle &&
+        next_status == PRELOAD_NONE && !playback.last_track_reached)
+    {
+        // Buffers are full, prepare the track change ahead of time
+        preload_next_track();
     }
+}
+
+void audio_transfer_begin()
+{
+    transfer_depth++;
+}
+
+void audio_transfer_end()
+{
+    if (transfer_depth > 0) transfer_depth--;
+}
 
+void audio_poll_transfer()
+{
+    if (audio_idle || audio_paused) return;
 
-    if (sbufst_a == FILLING) {
-        sbufst_a = PROCESSING;
-        snd_process_a();
-        sbufst_a = READY;
-    } else if (sbufst_b == FILLING) {
-        sbufst_b = PROCESSING;
-        snd_process_b();
-        sbufst_b = READY;
+    // Leave the SD card to the image transfer until
+    // playback would otherwise run out of samples.
+    while (audio_queued_us() < AUDIO_REFILL_DEADLINE_US)
+    {
+        if (!audio_refill() || audio_idle) break;
     }
 }
 
+void audio_get_stats(audio_stats_t *stats)
+{
+    stats->underruns = audio_stats.underruns;
+    stats->refills = audio_stats.refills;
+    stats->transfer_refills = audio_stats.transfer_refills;
+    stats->refill_latency_max_us = audio_stats.latency_max_us;
+    stats->refill_latency_avg_us = audio_stats.refills ? (uint32_t)(audio_stats.latency_total_us / audio_stats.refills) : 0;
+}
+
+void audio_log_stats()
+{
+    audio_stats_t stats;
+    audio_get_stats(&stats);
+    logmsg("Audio playback: ", (int)AUDIO_BUFFER_COUNT, " buffers of ", (int)AUDIO_BUFFER_SIZE, " bytes",
+           ", underruns ", (int)stats.underruns,
+           ", refills ", (int)stats.refills,
+           " (", (int)stats.transfer_refills, " during transfers)",
+           ", refill latency mean ", (int)stats.refill_latency_avg_us,
+           " us, max ", (int)stats.refill_latency_max_us, " us");
+}
+
+void audio_reset_stats()
+{
+    memset(&audio_stats, 0, sizeof(audio_stats));
+}
+
 static void audio_start_dma()
 {
     // read in initial sample buffers
-    if (within_gap)
+    uint32_t now = micros();
+    for (uint8_t i = 0; i < AUDIO_BUFFER_COUNT; i++)
     {
-        sbufst_a = READY;
-        sbufst_b = READY;
-        memset(output_buf_a, 0, sizeof(output_buf_a));
-        memset(output_buf_b, 0, sizeof(output_buf_b));
+        sbufst[i] = STALE;
+        stale_us[i] = now;
     }
-    else
+    fill_idx = 0;
+    for (uint8_t i = 0; i < AUDIO_BUFFER_COUNT; i++)
     {
-        sbufst_a = STALE;
-        sbufst_b = STALE;
-        sbufsel = B;
-        audio_poll();
-        sbufsel = A;
-        audio_poll();
+        if (!audio_refill()) break;
     }
+    if (audio_idle) return;
+
+    // First two buffers go directly to DMA, the rest are given
+    // from the interrupt handler when a channel finishes.
+    dma_buf_a = 0;
+    dma_buf_b = (sbufst[1] == READY) ? 1 : AUDIO_BUF_SILENCE;
+    play_idx = (dma_buf_b == 1) ? 2 : 1;
+    audio_stats.in_underrun = false;
+    play_start_us = micros();
+
     // setup the two DMA units to hand-off to each other
     // to maintain a stable bitstream these need to run without interruption
 	snd_dma_a_cfg = dma_channel_get_default_config(SOUND_DMA_CHA);
@@ -541,7 +674,7 @@ static void audio_start_dma()
     // version of pico-sdk lacks channel_config_set_high_priority()
     snd_dma_a_cfg.ctrl |= DMA_CH0_CTRL_TRIG_HIGH_PRIORITY_BITS;
 	dma_channel_configure(SOUND_DMA_CHA, &snd_dma_a_cfg, i2s.getPioFIFOAddr(),
-			output_buf_a, AUDIO_OUT_BUFFER_SIZE, false);
+			output_buf[0], out_len[0] / 4, false);
     dma_channel_set_irq0_enabled(SOUND_DMA_CHA, true);
 	snd_dma_b_cfg = dma_channel_get_default_config(SOUND_DMA_CHB);
 	channel_config_set_transfer_data_size(&snd_dma_b_cfg, DMA_SIZE_32);
@@ -550,7 +683,8 @@ static void audio_start_dma()
 	channel_config_set_chain_to(&snd_dma_b_cfg, SOUND_DMA_CHA);
     snd_dma_b_cfg.ctrl |= DMA_CH0_CTRL_TRIG_HIGH_PRIORITY_BITS;
 	dma_channel_configure(SOUND_DMA_CHB, &snd_dma_b_cfg, i2s.getPioFIFOAddr(),
-			output_buf_b, AUDIO_OUT_BUFFER_SIZE, false);
+			(dma_buf_b == 1) ? output_buf[1] : silence_buf,
+			(dma_buf_b == 1) ? out_len[1] / 4 : AUDIO_SILENCE_BUFFER_SIZE, false);
     dma_channel_set_irq0_enabled(SOUND_DMA_CHB, true);
 
     // ready to go
@@ -566,7 +700,8 @@ bool audio_play(uint32_t start, uint32_t length, bool swap) {
     // verify audio file is present and inputs are (somewhat) sane
     platform_set_sd_callback(NULL, NULL);
 
-    if(!setup_playback(start, length, false))
+    next_status = PRELOAD_NONE;
+    if(!setup_playback(start, length, false, &playback))
         return false;
 
     if (length == 0)
@@ -583,6 +718,11 @@ bool audio_play(uint32_t start, uint32_t length, bool swap) {
     audio_playing = true;
     audio_idle = false;
 
+    if (!playback.last_track_reached)
+    {
+        preload_next_track();
+    }
+
     audio_start_dma();
     return true;
 }
@@ -607,15 +747,15 @@ bool audio_play_wav(const char *filename)
 {
     if (!audio_idle) audio_stop();
 
-    if (!audio_file.open(filename, O_RDONLY))
+    if (!playback.file->open(filename, O_RDONLY))
     {
-        logmsg("Failed to open WAV: ", filename, " ", audio_file.getError());
+        logmsg("Failed to open WAV: ", filename, " ", playback.file->getError());
         return false;
     }
 
     // Read WAV file header and verify suitable format
     wav_header_t hdr = {};
-    if (audio_file.read(&hdr, sizeof(hdr)) != sizeof(hdr) ||
+    if (playback.file->read(&hdr, sizeof(hdr)) != sizeof(hdr) ||
         memcmp(hdr.riff, "RIFF", 4) != 0 ||
         memcmp(hdr.wave, "WAVE", 4) != 0 ||
         memcmp(hdr.fmt, "fmt ", 4) != 0)
@@ -643,10 +783,10 @@ bool audio_play_wav(const char *filename)
     audio_playing = true;
     audio_idle = false;
 
-    last_track_reached = true;
-    within_gap = false;
-    fleft = hdr.data_len;
-    fpos = sizeof(hdr);
+    playback.last_track_reached = true;
+    playback.within_gap = false;
+    playback.fleft = hdr.data_len;
+    playback.fpos = sizeof(hdr);
 
     audio_start_dma();
     return true;
@@ -670,9 +810,9 @@ bool audio_set_paused(bool paused) {
 void audio_stop() {
     if (audio_idle) return;
 
-    memset(&current_track, 0, sizeof(current_track));
-    memset(output_buf_a, 0, sizeof(output_buf_a));
-    memset(output_buf_b, 0, sizeof(output_buf_b));
+    memset(&playback.track, 0, sizeof(playback.track));
+    next_status = PRELOAD_NONE;
+    memset(output_buf, 0, sizeof(output_buf));
 
     // then indicate that the streams should no longer chain to one another
     // and wait for them to shut down naturally
@@ -708,11 +848,13 @@ uint16_t audio_get_volume() {
 void audio_set_volume(uint8_t lvol, uint8_t rvol) {
     volume[0] = lvol;
     volume[1] = rvol;
+    snd_update_gain();
 }
 
 void audio_set_max_volume(uint8_t max_vol)
 {
     max_volume = max_vol;
+    snd_update_gain();
 }
 
 uint16_t audio_get_channel() {
@@ -721,18 +863,19 @@ uint16_t audio_get_channel() {
 
 void audio_set_channel(uint16_t chn) {
     channel = chn;
+    snd_update_gain();
 }
 
 uint32_t audio_get_lba_position()
 {
-    if (current_track.track_number != 0 && audio_file.isOpen())
+    if (playback.track.track_number != 0 && playback.file->isOpen())
     {
         // We need the file position from the start of the track,
-        // current_track.file_offset equivalent to data_start (index 1 in cue file)
-        // index0_offset is the adjustment to current_track.file_offset
-        // to make it equivalent to current_track.track_start (index 0 in cue file)
-        uint64_t index0_offset = (current_track.data_start -  current_track.track_start) * current_track.sector_length;
-        return current_track.track_start + (audio_file.position() - (current_track.file_offset - index0_offset)) / current_track.sector_length;
+        // playback.track.file_offset equivalent to data_start (index 1 in cue file)
+        // index0_offset is the adjustment to playback.track.file_offset
+        // to make it equivalent to playback.track.track_start (index 0 in cue file)
+        uint64_t index0_offset = (playback.track.data_start -  playback.track.track_start) * playback.track.sector_length;
+        return playback.track.track_start + (playback.file->position() - (playback.track.file_offset - index0_offset)) / playback.track.sector_length;
     }
     else
     {
@@ -741,27 +884,26 @@ uint32_t audio_get_lba_position()
 }
 
 
-void audio_set_cue_parser(char *cue_file_name, FsFile* file)
+void audio_set_track_table(const cdrom_track_table_t *tracks, FsFile* file)
 {
     // Reset volume whenever a image changes
     audio_set_volume(DEFAULT_VOLUME_LEVEL, DEFAULT_VOLUME_LEVEL);
     audio_set_channel(AUDIO_CHANNEL_ENABLE_MASK);
+    g_tracks = tracks;
     if (file != nullptr)
     {
         char filename[MAX_FILE_PATH + 1] = {0};
         if (file->isFile())
         {
-            g_cue_parser.get_cue_file()->open(cue_file_name);
-            g_cue_parser.load_updated_cue();
             file->getName(filename, sizeof(filename));
-            audio_file.open(filename, O_RDONLY);
+            audio_files[1].close();
+            playback.file = &audio_files[0];
+            playback.file->open(filename, O_RDONLY);
             single_bin_file = true;
         }
         else if (file->isDir())
         {
             file->getName(filename, sizeof(filename));
-            g_cue_parser.get_cue_file()->open(file, cue_file_name);
-            g_cue_parser.load_updated_cue();
             audio_parent.open(filename, O_RDONLY);
             single_bin_file = false;
         }
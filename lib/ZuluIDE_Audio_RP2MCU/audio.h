@@ -24,9 +24,18 @@
 
 #include <stdint.h>
 
-// size of the two audio sample buffers, in bytes
-// #define AUDIO_BUFFER_SIZE 8192 // reduce memory usage
-#define AUDIO_BUFFER_SIZE 2352 * 4
+// number of audio sample buffers in the playback ring and size of each, in bytes
+#ifndef AUDIO_BUFFER_COUNT
+#define AUDIO_BUFFER_COUNT 4
+#endif
+#define AUDIO_BUFFER_SIZE (2352 * 2)
+
+// While an image file transfer is active, sample buffers are refilled
+// only when less than this much audio remains queued for playback.
+#ifndef AUDIO_REFILL_DEADLINE_US
+#define AUDIO_REFILL_DEADLINE_US 60000
+#endif
+
 /**
  * Indicates if the audio subsystem is actively streaming, including if it is
  * sending silent data during sample stall events.
@@ -57,4 +66,14 @@ void audio_set_max_volume(uint8_t max_vol);
  */
 void audio_poll();
 
+/**
+ * Write sample buffer underrun and refill latency statistics to log.
+ */
+void audio_log_stats();
+
+/**
+ * Clear sample buffer statistics.
+ */
+void audio_reset_stats();
+
 #endif // ENABLE_AUDIO_OUTPUT
@@ -0,0 +1,79 @@
+/**
+ * Copyright (C) 2023 saybur
+ * Copyright (C) 2024 Rabbit Hole Computing LLC
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Under Section 7 of GPL version 3, you are granted additional
+ * permissions described in the ZuluIDE Hardware Support Library Exception
+ * (GPL-3.0_HSL_Exception.md), as published by Rabbit Hole Computing™.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+// Volume scaling of CD audio samples for I2S output.
+// Kept free of platform dependencies so that utils/audio_scale_test.cpp
+// can check it on the host against the original division formula.
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+// Scale is volume (0-255) times max_volume (0-100), this value passes samples unchanged
+#define AUDIO_SCALE_UNITY 25500
+
+// Reciprocal of AUDIO_SCALE_UNITY in Q30, truncated
+#define AUDIO_SCALE_RECIPROCAL ((uint32_t)((1UL << 30) / AUDIO_SCALE_UNITY))
+
+// Returns (int16_t)(sample * scale / AUDIO_SCALE_UNITY) with division rounding toward zero,
+// for scale up to 255 * 255. The reciprocal multiply can only underestimate the quotient,
+// by at most 3, and the correction step makes the result exact.
+static inline uint16_t audio_scale_sample(int16_t sample, uint32_t scale)
+{
+    uint32_t n = (uint32_t)(sample < 0 ? -(int32_t)sample : sample) * scale;
+    uint32_t q = ((n >> 15) * AUDIO_SCALE_RECIPROCAL) >> 15;
+    uint32_t r = n - q * AUDIO_SCALE_UNITY;
+    while (r >= AUDIO_SCALE_UNITY)
+    {
+        q++;
+        r -= AUDIO_SCALE_UNITY;
+    }
+    return (uint16_t)(sample < 0 ? -q : q);
+}
+
+// Scale packed stereo samples in place. Each 32-bit word holds the left channel
+// in the low half, and the two channels swap places in the I2S output word.
+static inline void audio_scale_words(uint32_t *buf, uint32_t words, uint32_t scale_l, uint32_t scale_r)
+{
+    if (scale_l == 0 && scale_r == 0)
+    {
+        memset(buf, 0, words * 4);
+    }
+    else if (scale_l == AUDIO_SCALE_UNITY && scale_r == AUDIO_SCALE_UNITY)
+    {
+        for (uint32_t i = 0; i < words; i++)
+        {
+            uint32_t w = buf[i];
+            buf[i] = (w >> 16) | (w << 16);
+        }
+    }
+    else
+    {
+        for (uint32_t i = 0; i < words; i++)
+        {
+            uint32_t w = buf[i];
+            uint16_t left = audio_scale_sample((int16_t)(w & 0xFFFF), scale_l);
+            uint16_t right = audio_scale_sample((int16_t)(w >> 16), scale_r);
+            buf[i] = right | ((uint32_t)left << 16);
+        }
+    }
+}
@@ -34,6 +34,17 @@
 #include <hardware/gpio.h>
 #include <SdFat.h>
 #include <SdCard/SdCardInfo.h>
+#include <algorithm>
+
+// Number of sectors in the bounce buffer used for unaligned transfers
+#ifndef SDIO_BOUNCE_SECTORS
+#define SDIO_BOUNCE_SECTORS 4
+#endif
+
+// Maximum time to wait for an erase command to complete
+#ifndef SDIO_ERASE_TIMEOUT_MS
+#define SDIO_ERASE_TIMEOUT_MS 30000
+#endif
 
 static uint32_t g_sdio_ocr; // Operating condition register from card
 static uint32_t g_sdio_rca; // Relative card address
@@ -41,7 +52,7 @@ static cid_t g_sdio_cid;
 static csd_t g_sdio_csd;
 static int g_sdio_error_line;
 static sdio_status_t g_sdio_error;
-static uint32_t g_sdio_dma_buf[128];
+static uint32_t g_sdio_dma_buf[128 * SDIO_BOUNCE_SECTORS];
 static uint32_t g_sdio_sector_count;
 
 #define checkReturnOk(call) ((g_sdio_error = (call)) == SDIO_OK ? true : logSDError(__LINE__))
@@ -88,6 +99,38 @@ static sd_callback_t get_stream_callback(const uint8_t *buf, uint32_t count, con
     return NULL;
 }
 
+// After a multi-block write, the card keeps D0 low while it programs the last data.
+// Instead of waiting for that in writeSectors(), the wait is done before the next
+// command that needs the card. This lets the caller receive data for the next
+// write while the card is busy.
+static bool g_sdio_write_busy;
+
+static bool waitWriteDone()
+{
+    if (!g_sdio_write_busy)
+    {
+        return true;
+    }
+
+    uint32_t end = millis() + 5000;
+    while (millis() < end && (sio_hw->gpio_in & (1 << SDIO_D0)) == 0)
+    {
+        if (m_stream_callback)
+        {
+            m_stream_callback(m_stream_count);
+        }
+    }
+
+    g_sdio_write_busy = false;
+    if ((sio_hw->gpio_in & (1 << SDIO_D0)) == 0)
+    {
+        logmsg("SdioCard: timeout waiting for previous write to complete");
+        return false;
+    }
+
+    return true;
+}
+
 bool SdioCard::begin(SdioConfig sdioConfig)
 {
     uint32_t reply;
@@ -295,7 +338,7 @@ bool SdioCard::stopTransmission(bool blocking)
 
 bool SdioCard::syncDevice()
 {
-    return true;
+    return waitWriteDone();
 }
 
 uint8_t SdioCard::type() const
@@ -326,8 +369,34 @@ bool SdioCard::writeStop()
 
 bool SdioCard::erase(uint32_t firstSector, uint32_t lastSector)
 {
-    logmsg("SdioCard::erase() not implemented");
-    return false;
+    if (!waitWriteDone()) return false;
+
+    // Cards up to 2GB use byte addressing, SDHC cards use sector addressing
+    uint32_t first = (type() == SD_CARD_TYPE_SDHC) ? firstSector : (firstSector * 512);
+    uint32_t last = (type() == SD_CARD_TYPE_SDHC) ? lastSector : (lastSector * 512);
+
+    uint32_t reply;
+    if (!checkReturnOk(rp2040_sdio_command_R1(CMD32, first, &reply)) || // ERASE_WR_BLK_START
+        !checkReturnOk(rp2040_sdio_command_R1(CMD33, last, &reply)) || // ERASE_WR_BLK_END
+        !checkReturnOk(rp2040_sdio_command_R1(CMD38, 0, &reply))) // ERASE
+    {
+        return false;
+    }
+
+    // Card keeps D0 low until the erase is done
+    uint32_t end = millis() + SDIO_ERASE_TIMEOUT_MS;
+    while (millis() < end && isBusy())
+    {
+        platform_reset_watchdog();
+    }
+
+    if (isBusy())
+    {
+        logmsg("SdioCard::erase(", firstSector, ", ", lastSector, ") timeout");
+        return false;
+    }
+
+    return true;
 }
 
 bool SdioCard::cardCMD6(uint32_t arg, uint8_t* status) {
@@ -344,10 +413,12 @@ bool SdioCard::readSCR(scr_t* scr) {
 
 bool SdioCard::writeSector(uint32_t sector, const uint8_t* src)
 {
+    if (!waitWriteDone()) return false;
+
     if (((uint32_t)src & 3) != 0)
     {
         // Buffer is not aligned, need to memcpy() the data to a temporary buffer.
-        memcpy(g_sdio_dma_buf, src, sizeof(g_sdio_dma_buf));
+        memcpy(g_sdio_dma_buf, src, 512);
         src = (uint8_t*)g_sdio_dma_buf;
     }
 
@@ -385,6 +456,8 @@ bool SdioCard::writeSector(uint32_t sector, const uint8_t* src)
 
 bool SdioCard::writeSectors(uint32_t sector, const uint8_t* src, size_t n)
 {
+    if (!waitWriteDone()) return false;
+
     if (((uint32_t)src & 3) != 0)
     {
         // Unaligned write, execute sector-by-sector
@@ -433,12 +506,20 @@ bool SdioCard::writeSectors(uint32_t sector, const uint8_t* src, size_t n)
     {
         // TODO: Instead of CMD12 stopTransmission command, according to SD spec we should send stopTran token.
         // stopTransmission seems to work in practice.
-        return stopTransmission(true);
+        // Programming of the last blocks is waited for by the next command or syncDevice(), see waitWriteDone().
+        if (!stopTransmission(false))
+        {
+            return false;
+        }
+        g_sdio_write_busy = true;
+        return true;
     }
 }
 
 bool SdioCard::readSector(uint32_t sector, uint8_t* dst)
 {
+    if (!waitWriteDone()) return false;
+
     uint8_t *real_dst = dst;
     if (((uint32_t)dst & 3) != 0)
     {
@@ -476,7 +557,7 @@ bool SdioCard::readSector(uint32_t sector, uint8_t* dst)
 
     if (dst != real_dst)
     {
-        memcpy(real_dst, g_sdio_dma_buf, sizeof(g_sdio_dma_buf));
+        memcpy(real_dst, g_sdio_dma_buf, 512);
     }
 
     return g_sdio_error == SDIO_OK;
@@ -484,10 +565,51 @@ bool SdioCard::readSector(uint32_t sector, uint8_t* dst)
 
 bool SdioCard::readSectors(uint32_t sector, uint8_t* dst, size_t n)
 {
-    if (((uint32_t)dst & 3) != 0 || sector + n >= g_sdio_sector_count)
+    if (!waitWriteDone()) return false;
+
+    if (((uint32_t)dst & 3) != 0)
     {
-        // Unaligned read or end-of-drive read, execute sector-by-sector
-        for (size_t i = 0; i < n; i++)
+        // Unaligned read, use multi-block reads to the bounce buffer and copy from there.
+        // Progress is reported to the callback after each copy. The stream callback is
+        // suspended during the inner reads, as stopTransmission() would otherwise report
+        // the whole range before it has been copied.
+        sd_callback_t callback = get_stream_callback(dst, n * 512, "readSectors", sector);
+        uint32_t count_start = m_stream_count_start;
+        sd_callback_t stream_callback = m_stream_callback;
+        m_stream_callback = NULL;
+
+        bool status = true;
+        for (size_t i = 0; i < n && status; i += SDIO_BOUNCE_SECTORS)
+        {
+            size_t count = std::min<size_t>(n - i, SDIO_BOUNCE_SECTORS);
+            status = readSectors(sector + i, (uint8_t*)g_sdio_dma_buf, count);
+
+            if (status)
+            {
+                memcpy(dst + 512 * i, g_sdio_dma_buf, 512 * count);
+
+                if (callback)
+                {
+                    callback(count_start + 512 * (i + count));
+                }
+            }
+        }
+
+        m_stream_callback = stream_callback;
+        return status;
+    }
+
+    if (sector + n >= g_sdio_sector_count)
+    {
+        // CMD18 can report an error when the card reads ahead past the last sector.
+        // Read up to the last sector with CMD18 and the rest sector-by-sector.
+        size_t multi = (g_sdio_sector_count > sector + 1) ? (g_sdio_sector_count - 1 - sector) : 0;
+        if (multi > 0 && !readSectors(sector, dst, multi))
+        {
+            return false;
+        }
+
+        for (size_t i = multi; i < n; i++)
         {
             if (!readSector(sector + i, dst + 512 * i))
             {
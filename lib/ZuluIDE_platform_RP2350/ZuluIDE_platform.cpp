@@ -28,6 +28,7 @@
 #include "ZuluIDE_config.h"
 #include <ZuluIDE.h>
 #include "ide_phy.h"
+#include "ide_stats.h"
 #include <SdFat.h>
 #include <assert.h>
 #include <hardware/gpio.h>
@@ -770,6 +771,20 @@ void platform_reset_mcu()
 
 void usb_command_handler(char *cmd)
 {
+    if (strcasecmp(cmd, "stats") == 0)
+    {
+        ide_stats_log();
+#ifdef ENABLE_AUDIO_OUTPUT
+        audio_log_stats();
+#endif
+    }
+    else if (strcasecmp(cmd, "stats reset") == 0)
+    {
+        ide_stats_reset();
+#ifdef ENABLE_AUDIO_OUTPUT
+        audio_reset_stats();
+#endif
+    }
 }
 
 // Poll for commands sent through the USB serial port
@@ -781,6 +781,11 @@ void load_image(const zuluide::images::Image& toLoad, bool insert)
    
   logmsg("Loading image \"", toLoad.GetFilename().c_str(), "\"");
   g_ide_imagefile.open_file(toLoad.GetFilename().c_str(), false);
+  if (ini_getbool("IDE", "benchmark_image", 0, CONFIGFILE))
+  {
+    g_ide_imagefile.benchmark(IMAGE_BENCHMARK_SIZE);
+  }
+
   if (g_ide_device) {
     if (insert)
       g_ide_device->insert_media(&g_ide_imagefile);
@@ -957,6 +962,8 @@ void zuluide_main_loop(void)
       ide_protocol_poll();
     }
 
+    g_ide_imagefile.poll();
+
 #ifdef PLATFORM_HAS_SNIFFER
     if (g_sniffer_mode != SNIFFER_OFF)
     {
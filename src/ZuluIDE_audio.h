@@ -27,6 +27,8 @@
 
 #include <stdint.h>
 #include <CUEParser.h>
+
+struct cdrom_track_table_t;
 /*
  * Starting volume level for audio output, with 0 being muted and 255 being
  * max volume. SCSI-2 says this should be 25% of maximum by default, MMC-1
@@ -60,6 +62,17 @@ enum audio_status_code {
     ASC_NO_STATUS = 0x15
 };
 
+/*
+ * Sample buffer statistics, for diagnosing dropouts in audio playback.
+ */
+struct audio_stats_t {
+    uint32_t underruns; // Number of times DMA ran out of filled buffers and played silence
+    uint32_t refills; // Number of sample buffers read from SD card
+    uint32_t transfer_refills; // Refills interleaved with image file transfers
+    uint32_t refill_latency_max_us; // Time from buffer played to filled again
+    uint32_t refill_latency_avg_us;
+};
+
 /**
  * Indicates whether there is an active playback event for a given target.
  *
@@ -162,8 +175,29 @@ void audio_set_file_position(uint32_t lba);
 
 
 /**
- * Sets the cue_parser
- * cue_filename - the cue file to use
- * filename - the filename for the bin file for a non directory bin/cue combination
+ * Sets the track layout used for playback
+ * tracks - track table of the loaded image, owned by the CD-ROM device and
+ *          kept up to date by it until the next call
+ * file - the bin file for a non directory bin/cue combination, or the image folder
+ */
+void audio_set_track_table(const cdrom_track_table_t *tracks, FsFile *file);
+
+/**
+ * Marks the start and end of an image file transfer. While a transfer is
+ * active, audio_poll() does not access the SD card, because it may be called
+ * from within an SD card callback. Calls can be nested.
+ */
+void audio_transfer_begin();
+void audio_transfer_end();
+
+/**
+ * Called between SD card accesses of an image file transfer. Refills sample
+ * buffers only if playback would otherwise run out of samples before the
+ * next opportunity.
+ */
+void audio_poll_transfer();
+
+/**
+ * Gets sample buffer statistics since boot or last reset.
  */
-void audio_set_cue_parser(char * cue_filename, FsFile *file);
+void audio_get_stats(audio_stats_t *stats);
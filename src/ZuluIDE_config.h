@@ -62,6 +62,31 @@
 #endif
 #define LOG_SAVE_INTERVAL_MS 1000
 
+// Delay after last cached write before write-back cache is flushed to SD card
+#ifndef WRITE_CACHE_FLUSH_DELAY_MS
+#define WRITE_CACHE_FLUSH_DELAY_MS 500
+#endif
+
+// Amount of data read from SD card per main loop iteration for read-ahead
+#ifndef READAHEAD_CHUNK_SIZE
+#define READAHEAD_CHUNK_SIZE 4096
+#endif
+
+// Amount of data read from start of image when benchmark_image is enabled
+#ifndef IMAGE_BENCHMARK_SIZE
+#define IMAGE_BENCHMARK_SIZE (4 * 1024 * 1024)
+#endif
+
+// Sequential writes of at least this size get their speed reported in log
+// after writing has been idle for WRITE_SPEED_LOG_IDLE_MS.
+#ifndef WRITE_SPEED_LOG_MIN_BYTES
+#define WRITE_SPEED_LOG_MIN_BYTES (4 * 1024 * 1024)
+#endif
+
+#ifndef WRITE_SPEED_LOG_IDLE_MS
+#define WRITE_SPEED_LOG_IDLE_MS 1000
+#endif
+
 // Watchdog timeout
 // Watchdog will first issue a bus reset and if that does not help, crashdump.
 #define WATCHDOG_BUS_RESET_TIMEOUT 15000
@@ -26,6 +26,7 @@
 
 #include <SdFat.h>
 #include <cstring>
+#include <algorithm>
 #include <ZuluIDE_platform.h>
 #include "ZuluIDE_config.h"
 #include "ZuluIDE_create_image.h"
@@ -33,6 +34,14 @@
 
 extern SdFs SD;
 
+// Number of sectors erased with one command when creating images
+#ifndef CREATE_IMAGE_ERASE_SECTORS
+#define CREATE_IMAGE_ERASE_SECTORS (64 * 2048)
+#endif
+
+// Number of sectors spread over the image that are read back after erase
+#define CREATE_IMAGE_VERIFY_SAMPLES 8
+
 static bool parseCreateCommand(const char *cmd_filename, uint64_t &size, char imgname[MAX_FILE_PATH + 1])
 {
   if (strncasecmp(cmd_filename, CREATEFILE, strlen(CREATEFILE)) != 0)
@@ -114,6 +123,55 @@ static bool parseCreateCommand(const char *cmd_filename, uint64_t &size, char im
 
 
 
+// Zeroes a contiguous preallocated image by erasing its sectors on the SD card.
+// Returns false if this is not possible and the file must be filled with zeros instead.
+static bool eraseImageFile(FsFile &file, uint8_t *read_buf)
+{
+  uint32_t first, last;
+  if (!file.contiguousRange(&first, &last))
+  {
+    return false;
+  }
+
+  SdCard *card = SD.card();
+  uint32_t sector = first;
+  while (sector <= last)
+  {
+    if (millis() & 128) { LED_ON(); } else { LED_OFF(); }
+    platform_reset_watchdog();
+
+    uint32_t count = std::min<uint32_t>(last - sector + 1, CREATE_IMAGE_ERASE_SECTORS);
+    if (!card->erase(sector, sector + count - 1))
+    {
+      logmsg("-- SD card erase failed at sector ", sector);
+      return false;
+    }
+    sector += count;
+  }
+
+  // Depending on the card, erased sectors can read as all ones instead of zeros
+  for (int i = 0; i < CREATE_IMAGE_VERIFY_SAMPLES; i++)
+  {
+    sector = first + (uint32_t)((uint64_t)(last - first) * i / (CREATE_IMAGE_VERIFY_SAMPLES - 1));
+    if (!card->readSector(sector, read_buf))
+    {
+      logmsg("-- Reading erased sector ", sector, " failed");
+      return false;
+    }
+
+    for (int j = 0; j < 512; j++)
+    {
+      if (read_buf[j] != 0)
+      {
+        logmsg("-- Erased sectors on SD card do not read as zeros");
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
 bool createImageFile(const char *imgname, uint64_t size, uint8_t *write_buf, size_t write_buf_len)
 {
   int namelen = strlen(imgname);
@@ -129,15 +187,24 @@ bool createImageFile(const char *imgname, uint64_t size, uint8_t *write_buf, siz
   LED_ON();
   FsFile file = SD.open(imgname, O_WRONLY | O_CREAT);
 
+  uint32_t start = millis();
   if (!file.preAllocate(size))
   {
     logmsg("-- Preallocation didn't find contiguous set of clusters, continuing anyway");
   }
+  else if (file.size() == size && eraseImageFile(file, write_buf))
+  {
+    // FAT sets the file size at preallocation, exFAT still needs the data written
+    file.close();
+    LED_OFF();
+    logmsg("-- Image creation successful using SD card erase, took ", (int)(millis() - start), " ms");
+    return true;
+  }
 
   int blocks = size/write_buf_len;
 
   // Write zeros to fill the file
-  uint32_t start = millis();
+  file.seek(0);
   memset(write_buf, 0, write_buf_len);
   uint64_t remain = size;
 
@@ -201,7 +268,7 @@ bool createImageFile(const char *imgname, uint64_t size, uint8_t *write_buf, siz
   file.close();
   uint32_t time = millis() - start;
   int kb_per_s = size / time;
-  logmsg("-- Image creation successful, write speed ", kb_per_s, " kB/s");
+  logmsg("-- Image creation successful by writing zeros, took ", (int)time, " ms, write speed ", kb_per_s, " kB/s");
 
   LED_OFF();
   return true;
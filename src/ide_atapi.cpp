@@ -25,6 +25,7 @@
 
 #include "ide_atapi.h"
 #include "ide_utils.h"
+#include "ide_stats.h"
 #include "atapi_constants.h"
 #include "ZuluIDE.h"
 #include "ZuluIDE_config.h"
@@ -292,6 +293,7 @@ bool IDEATAPIDevice::cmd_identify_packet_device(ide_registers_t *regs)
 
     ide_phy_start_write(sizeof(idf));
     ide_phy_write_block((uint8_t*)idf, sizeof(idf));
+    ide_stats_add_bytes(sizeof(idf));
 
     uint32_t start = millis();
     while (!ide_phy_is_write_finished())
@@ -382,6 +384,7 @@ bool IDEATAPIDevice::cmd_packet(ide_registers_t *regs)
     ide_phy_read_block(cmdbuf, sizeof(cmdbuf));
 
     dbgmsg("-- ATAPI command: ", get_atapi_command_name(cmdbuf[0]), " ", bytearray(cmdbuf, 12));
+    ide_stats_set_atapi_command(cmdbuf[0]);
 
     return handle_atapi_command_wrapper(cmdbuf);
 }
@@ -493,30 +496,6 @@ bool IDEATAPIDevice::atapi_send_data(const uint8_t *data, size_t blocksize, size
 
 ssize_t IDEATAPIDevice::atapi_send_data_async(const uint8_t *data, size_t blocksize, size_t num_blocks)
 {
-    if (m_atapi_state.data_state == ATAPI_DATA_WRITE &&
-        blocksize == m_atapi_state.blocksize)
-    {
-        // Fast path, transfer size has already been set up
-        size_t blocks_sent = 0;
-        while (blocks_sent < num_blocks && ide_phy_can_write_block())
-        {
-            ide_phy_write_block(data, blocksize);
-            data += blocksize;
-            blocks_sent++;
-        }
-
-        if (blocks_sent == 0)
-        {
-            if (ide_phy_is_command_interrupted())
-            {
-                dbgmsg("atapi_send_data_async(): interrupted");
-                return -1;
-            }
-        }
-
-        return blocks_sent;
-    }
-
     size_t max_blocksize = std::min<size_t>(m_phy_caps.max_blocksize, m_atapi_state.bytes_req);
     if (blocksize > max_blocksize)
     {
@@ -532,17 +511,62 @@ ssize_t IDEATAPIDevice::atapi_send_data_async(const uint8_t *data, size_t blocks
             return -1;
         }
     }
-    else
+
+    // Consecutive blocks are merged to one DRQ block as far as the host byte count
+    // limit and PHY allow. This reduces the number of interrupts on the host side.
+    size_t group = max_blocksize / blocksize;
+
+    if (m_atapi_state.data_state == ATAPI_DATA_WRITE &&
+        blocksize * group == m_atapi_state.blocksize)
     {
-        // Start transmission of first data block
-        if (atapi_send_data_block(data, blocksize))
+        // Fast path, transfer size has already been set up
+        size_t blocks_sent = 0;
+        while (blocks_sent + group <= num_blocks && ide_phy_can_write_block())
         {
-            return 1;
+            ide_phy_write_block(data, blocksize * group);
+            data += blocksize * group;
+            blocks_sent += group;
         }
-        else
+        ide_stats_add_bytes(blocks_sent * blocksize);
+
+        if (blocks_sent > 0)
+        {
+            return blocks_sent;
+        }
+        else if (ide_phy_is_command_interrupted())
+        {
+            dbgmsg("atapi_send_data_async(): interrupted");
+            return -1;
+        }
+        else if (num_blocks >= group)
+        {
+            // Wait for hardware buffer space
+            return 0;
+        }
+    }
+
+    if (num_blocks < group && m_atapi_state.data_state == ATAPI_DATA_WRITE && !ide_phy_is_write_finished())
+    {
+        // Wait for more data to fill a whole group while previous blocks are being sent.
+        // Once hardware is idle, whatever is available is sent as a smaller block,
+        // which covers the end of the transfer and the image buffer wrapping around.
+        if (ide_phy_is_command_interrupted())
         {
+            dbgmsg("atapi_send_data_async(): interrupted");
             return -1;
         }
+        return 0;
+    }
+
+    // Start transmission of first data block
+    size_t count = std::min(group, num_blocks);
+    if (atapi_send_data_block(data, blocksize * count))
+    {
+        return count;
+    }
+    else
+    {
+        return -1;
     }
 }
 
@@ -585,6 +609,7 @@ bool IDEATAPIDevice::atapi_send_data_block(const uint8_t *data, uint16_t blocksi
         int udma_mode = (m_atapi_state.dma_requested ? m_atapi_state.udma_mode : -1);
         ide_phy_start_write(blocksize, udma_mode);
         ide_phy_write_block(data, blocksize);
+        ide_stats_add_bytes(blocksize);
     }
     else
     {
@@ -608,6 +633,7 @@ bool IDEATAPIDevice::atapi_send_data_block(const uint8_t *data, uint16_t blocksi
         }
 
         ide_phy_write_block(data, blocksize);
+        ide_stats_add_bytes(blocksize);
     }
 
     return true;
@@ -701,6 +727,7 @@ bool IDEATAPIDevice::atapi_recv_data(uint8_t *data, size_t blocksize, size_t num
         // Read out previous block
         bool continue_transfer = (i + 1 < num_blocks);
         ide_phy_read_block(data + blocksize * i, blocksize, continue_transfer);
+        ide_stats_add_bytes(blocksize);
     }
 
     ide_phy_stop_transfers(&m_atapi_state.crc_errors);
@@ -748,6 +775,7 @@ bool IDEATAPIDevice::atapi_recv_data_block(uint8_t *data, uint16_t blocksize)
     }
 
     ide_phy_read_block(data, blocksize);
+    ide_stats_add_bytes(blocksize);
 
     ide_phy_stop_transfers(&m_atapi_state.crc_errors);
     if (m_atapi_state.crc_errors > 0)
@@ -36,6 +36,7 @@
 
 #include "ide_cdrom.h"
 #include "ide_utils.h"
+#include "ide_cdrom_ecc.h"
 #include "atapi_constants.h"
 #include "ZuluIDE_log.h"
 #include "ZuluIDE_config.h"
@@ -217,6 +218,22 @@ static int32_t MSF2LBA(uint8_t m, uint8_t s, uint8_t f, bool relative)
 
 static void doStopAudio();
 
+// Convert subchannel data stored one channel after another (12 bytes each for P to W)
+// to the raw format returned by READ CD, where each byte has one bit of every channel.
+// Refer to ECMA-130 22.1
+static void interleaveSubchannel(const uint8_t *src, uint8_t *dest)
+{
+    for (int i = 0; i < 96; i++)
+    {
+        uint8_t value = 0;
+        for (int ch = 0; ch < 8; ch++)
+        {
+            value |= ((src[ch * 12 + i / 8] >> (7 - (i % 8))) & 1) << (7 - ch);
+        }
+        dest[i] = value;
+    }
+}
+
 // Format track info read from cue sheet into the format used by ReadTOC command.
 // Refer to T10/1545-D MMC-4 Revision 5a, "Response Format 0000b: Formatted TOC"
 static void formatTrackInfo(const CUETrackInfo *track, uint8_t *dest, bool use_MSF_time)
@@ -300,6 +317,7 @@ void IDECDROMDevice::initialize(int devidx)
 
     set_esn_event(esn_event_t::NoChange);
 
+    memset(&m_metadata_cache, 0, sizeof(m_metadata_cache));
     clear_cached_track_info();
 
     m_eject_then_load_cycle = false;
@@ -319,9 +337,13 @@ void IDECDROMDevice::set_image(IDEImage *image)
     memset(&m_first_track, 0, sizeof(m_first_track));
     memset(&m_last_track, 0, sizeof(m_last_track));
     memset(&m_cd_read_format, 0, sizeof(m_cd_read_format));
+    m_subchannel.file.close();
+    m_subchannel.file_index = -1;
+    m_subchannel.available = false;
     IDEImageFile *imagefile = (IDEImageFile*)m_image;
     m_selected_file_index = -1;
     static char cuesheetname[MAX_FILE_PATH + 1];
+    FsFile *audio_file = nullptr;
     if (m_image &&
         !m_image->is_folder() &&
         m_image->get_filename(m_filename, sizeof(m_filename)) &&
@@ -333,10 +355,8 @@ void IDECDROMDevice::set_image(IDEImage *image)
         strncpy(cuesheetname, m_filename, strlen(m_filename) - 4);
         strlcat(cuesheetname, ".cue", sizeof(cuesheetname));
         valid = loadAndValidateCueSheet(imagefile->get_folder(), cuesheetname, m_first_track, m_last_track);
-#ifdef ENABLE_AUDIO_OUTPUT
         if (valid)
-            audio_set_cue_parser(cuesheetname, imagefile->get_file());
-#endif // ENABLE_AUDIO_OUTPUT
+            audio_file = imagefile->get_file();
     }
     else if (m_image && m_image->is_folder())
     {
@@ -366,12 +386,10 @@ void IDECDROMDevice::set_image(IDEImage *image)
             logmsg("No valid .cue sheet found in folder '", foldername, "'");
             m_image = nullptr;
         }
-#ifdef ENABLE_AUDIO_OUTPUT
         else
         {
-            audio_set_cue_parser(cuesheetname, folder);
+            audio_file = folder;
         }
-#endif // ENABLE_AUDIO_OUTPUT
     }
 
     if (!valid && m_image)
@@ -385,6 +403,22 @@ void IDECDROMDevice::set_image(IDEImage *image)
         }
     }
 
+    if (m_image && !buildTrackTable())
+    {
+        m_image = nullptr;
+        valid = false;
+    }
+
+    if (m_image)
+    {
+        buildTocCache();
+        buildMetadataCache();
+#ifdef ENABLE_AUDIO_OUTPUT
+        if (audio_file)
+            audio_set_track_table(&m_tracks, audio_file);
+#endif // ENABLE_AUDIO_OUTPUT
+    }
+
     if (m_image && tracks_valid())
     {
         bool firstaudio = (m_first_track.track_mode == CUETrack_AUDIO);
@@ -479,23 +513,14 @@ bool IDECDROMDevice::atapi_read_disc_information(const uint8_t *cmd)
 
     uint16_t allocationLength = parse_be16(&cmd[7]);
 
-    // Take the hardcoded header as base
-    uint8_t *buf = m_buffer.bytes;
-    uint32_t len = sizeof(DiscInformation);
-    memcpy(buf, DiscInformation, len);
-
-    // Find first and last track number
-    if (!tracks_valid())
+    if (!tracks_valid() || !buildTocCache())
     {
         logmsg("atapi_read_disc_information() failed to get track info");
         return atapi_cmd_error(ATAPI_SENSE_ABORTED_CMD, ATAPI_ASC_NO_MEDIUM);
     }
 
-    buf[3] = m_first_track.track_number;
-    buf[5] = m_first_track.track_number;
-    buf[6] = m_last_track.track_number;
-
-    atapi_send_data(buf, std::min<uint32_t>(allocationLength, len));
+    uint32_t len = sizeof(m_toc_cache.disc_info);
+    atapi_send_data(m_toc_cache.disc_info, std::min<uint32_t>(allocationLength, len));
     return atapi_cmd_ok();
 }
 
@@ -1043,53 +1068,42 @@ bool IDECDROMDevice::atapi_mechanism_status(const uint8_t *cmd)
 
 bool IDECDROMDevice::doReadTOC(bool MSF, uint8_t track, uint16_t allocationLength)
 {
-    uint8_t *buf = m_buffer.bytes;
-
-    // Format track info
-    uint8_t *trackdata = &buf[4];
-    int trackcount = 0;
-    int firsttrack = -1;
-    CUETrackInfo lasttrack = {0};
-    const CUETrackInfo *trackinfo;
-    uint64_t prev_capacity = 0;
-    m_cueparser.restart();
-    while ((trackinfo = m_cueparser.next_track(prev_capacity)) != NULL)
+    if (!buildTocCache())
     {
-        if (firsttrack < 0) firsttrack = trackinfo->track_number;
-        lasttrack = *trackinfo;
-
-        if (track <= trackinfo->track_number)
-        {
-            formatTrackInfo(trackinfo, &trackdata[8 * trackcount], MSF);
-            trackcount += 1;
-        }
-
-        selectBinFileForTrack(trackinfo);
-        prev_capacity = m_image->capacity();
+        return atapi_cmd_error(ATAPI_SENSE_ABORTED_CMD, ATAPI_ASC_NO_MEDIUM);
     }
 
-    // Format lead-out track info
-    CUETrackInfo leadout = {};
-    leadout.track_number = 0xAA;
-    leadout.track_mode = (lasttrack.track_number != 0) ? lasttrack.track_mode : CUETrack_MODE1_2048;
-    leadout.data_start = getLeadOutLBA(&lasttrack);
-    formatTrackInfo(&leadout, &trackdata[8 * trackcount], MSF);
-    trackcount += 1;
+    const uint8_t *toc = MSF ? m_toc_cache.toc_msf : m_toc_cache.toc_lba;
 
-    // Format response header
-    uint16_t toc_length = 2 + trackcount * 8;
-    buf[0] = toc_length >> 8;
-    buf[1] = toc_length & 0xFF;
-    buf[2] = firsttrack;
-    buf[3] = lasttrack.track_number;
+    // Skip descriptors of tracks before the requested one
+    int skip = 0;
+    while (skip < m_tracks.count && m_tracks.entries[skip].track_number < track)
+    {
+        skip++;
+    }
 
-    if (track != 0xAA && trackcount < 2)
+    if (track != 0xAA && skip >= m_tracks.count)
     {
         // Unknown track requested
         return atapi_cmd_error(ATAPI_SENSE_ILLEGAL_REQ, ATAPI_ASC_INVALID_FIELD);
     }
+    else if (skip == 0)
+    {
+        // Full table can be sent as is
+        uint32_t len = 2 + m_toc_cache.toc_len;
+        atapi_send_data(toc, std::min<uint32_t>(allocationLength, len));
+        return atapi_cmd_ok();
+    }
     else
     {
+        uint8_t *buf = m_buffer.bytes;
+        uint16_t toc_length = m_toc_cache.toc_len - skip * 8;
+        buf[0] = toc_length >> 8;
+        buf[1] = toc_length & 0xFF;
+        buf[2] = toc[2];
+        buf[3] = toc[3];
+        memcpy(&buf[4], &toc[4 + skip * 8], toc_length - 2);
+
         uint32_t len = 2 + toc_length;
         atapi_send_data(buf, std::min<uint32_t>(allocationLength, len));
         return atapi_cmd_ok();
@@ -1098,20 +1112,13 @@ bool IDECDROMDevice::doReadTOC(bool MSF, uint8_t track, uint16_t allocationLengt
 
 bool IDECDROMDevice::doReadSessionInfo(bool MSF, uint16_t allocationLength)
 {
-    uint32_t len = sizeof(SessionTOC);
-    uint8_t *buf = m_buffer.bytes;
-    memcpy(buf, SessionTOC, len);
-
-    // Replace first track info in the session table
-    // based on data from CUE sheet.
-    m_cueparser.restart();
-    const CUETrackInfo *trackinfo = m_cueparser.next_track();
-    if (trackinfo)
+    if (!buildTocCache())
     {
-        formatTrackInfo(trackinfo, &buf[4], false);
+        return atapi_cmd_error(ATAPI_SENSE_ABORTED_CMD, ATAPI_ASC_NO_MEDIUM);
     }
 
-    atapi_send_data(buf, std::min<uint32_t>(allocationLength, len));
+    uint32_t len = sizeof(m_toc_cache.session_info);
+    atapi_send_data(m_toc_cache.session_info, std::min<uint32_t>(allocationLength, len));
     return atapi_cmd_ok();
 }
 
@@ -1123,66 +1130,335 @@ bool IDECDROMDevice::doReadFullTOC(uint8_t session, uint16_t allocationLength, b
         return atapi_cmd_error(ATAPI_SENSE_ILLEGAL_REQ, ATAPI_ASC_INVALID_FIELD);
     }
 
-    // Take basic header as the base
-    uint8_t *buf = m_buffer.bytes;
-    uint32_t len = sizeof(FullTOCHeader);
-    memcpy(buf, FullTOCHeader, len);
+    if (!buildTocCache())
+    {
+        return atapi_cmd_error(ATAPI_SENSE_ABORTED_CMD, ATAPI_ASC_NO_MEDIUM);
+    }
 
-    // Add track descriptors
-    int trackcount = 0;
-    int firsttrack = -1;
-    CUETrackInfo lasttrack = {0};
-    const CUETrackInfo *trackinfo;
-    uint64_t prev_capacity = 0;
-    m_cueparser.restart();
-    while ((trackinfo = m_cueparser.next_track(prev_capacity)) != NULL)
+    const uint8_t *buf = useBCD ? m_toc_cache.full_toc_bcd : m_toc_cache.full_toc;
+    atapi_send_data(buf, std::min<uint32_t>(allocationLength, m_toc_cache.full_toc_len));
+    return atapi_cmd_ok();
+}
+
+// Format the responses to TOC and disc information queries from the track table.
+// Returns true if the cached responses are valid.
+bool IDECDROMDevice::buildTocCache()
+{
+    static_assert(sizeof(m_toc_cache.session_info) == sizeof(SessionTOC), "Session info size mismatch");
+    static_assert(sizeof(m_toc_cache.disc_info) == sizeof(DiscInformation), "Disc info size mismatch");
+    static_assert(sizeof(m_toc_cache.full_toc) >= sizeof(FullTOCHeader) + CDROM_MAX_TRACKS * 11, "Full TOC size mismatch");
+
+    if (m_toc_cache.valid) return true;
+    if (m_tracks.count == 0) return false;
+
+    const cdrom_track_entry_t *first = &m_tracks.entries[0];
+    const cdrom_track_entry_t *last = &m_tracks.entries[m_tracks.count - 1];
+    CUETrackInfo trackinfo;
+
+    // Track descriptors
+    for (int i = 0; i < m_tracks.count; i++)
     {
-        if (firsttrack < 0)
+        trackinfo = cdrom_track_info(&m_tracks, i);
+        formatTrackInfo(&trackinfo, &m_toc_cache.toc_lba[4 + 8 * i], false);
+        formatTrackInfo(&trackinfo, &m_toc_cache.toc_msf[4 + 8 * i], true);
+        formatRawTrackInfo(&trackinfo, &m_toc_cache.full_toc[sizeof(FullTOCHeader) + 11 * i], false);
+        formatRawTrackInfo(&trackinfo, &m_toc_cache.full_toc_bcd[sizeof(FullTOCHeader) + 11 * i], true);
+
+        if (i == 0)
         {
-            firsttrack = trackinfo->track_number;
-            if (trackinfo->track_mode == CUETrack_AUDIO)
+            // Session info has the first track descriptor
+            memcpy(m_toc_cache.session_info, SessionTOC, sizeof(SessionTOC));
+            formatTrackInfo(&trackinfo, &m_toc_cache.session_info[4], false);
+        }
+    }
+
+    // Lead-out track, its position is determined by the size of the last track file
+    memset(&trackinfo, 0, sizeof(trackinfo));
+    trackinfo.track_number = 0xAA;
+    trackinfo.track_mode = (CUETrackMode)last->track_mode;
+    trackinfo.data_start = last->end_lba;
+    formatTrackInfo(&trackinfo, &m_toc_cache.toc_lba[4 + 8 * m_tracks.count], false);
+    formatTrackInfo(&trackinfo, &m_toc_cache.toc_msf[4 + 8 * m_tracks.count], true);
+
+    // Formatted TOC header
+    m_toc_cache.toc_len = 2 + (m_tracks.count + 1) * 8;
+    uint8_t header[4] = {(uint8_t)(m_toc_cache.toc_len >> 8), (uint8_t)(m_toc_cache.toc_len & 0xFF),
+                         first->track_number, last->track_number};
+    memcpy(m_toc_cache.toc_lba, header, sizeof(header));
+    memcpy(m_toc_cache.toc_msf, header, sizeof(header));
+
+    // Raw TOC header with A0-A2 descriptors
+    m_toc_cache.full_toc_len = sizeof(FullTOCHeader) + 11 * m_tracks.count;
+    for (int bcd = 0; bcd < 2; bcd++)
+    {
+        uint8_t *buf = bcd ? m_toc_cache.full_toc_bcd : m_toc_cache.full_toc;
+        memcpy(buf, FullTOCHeader, sizeof(FullTOCHeader));
+
+        uint16_t toclen = m_toc_cache.full_toc_len - 2;
+        buf[0] = toclen >> 8;
+        buf[1] = toclen & 0xFF;
+
+        // First and last track numbers
+        buf[12] = first->track_number;
+        buf[23] = last->track_number;
+        if (first->track_mode == CUETrack_AUDIO)
+        {
+            buf[5] = 0x10;
+        }
+        if (last->track_mode == CUETrack_AUDIO)
+        {
+            buf[16] = 0x10;
+            buf[27] = 0x10;
+        }
+
+        // Leadout track position
+        if (bcd) {
+            LBA2MSFBCD(last->end_lba, &buf[34], false);
+        } else {
+            LBA2MSF(last->end_lba, &buf[34], false);
+        }
+    }
+
+    // Disc information
+    memcpy(m_toc_cache.disc_info, DiscInformation, sizeof(DiscInformation));
+    m_toc_cache.disc_info[3] = first->track_number;
+    m_toc_cache.disc_info[5] = first->track_number;
+    m_toc_cache.disc_info[6] = last->track_number;
+
+    m_toc_cache.valid = true;
+    return true;
+}
+
+/**************************************/
+/* ISO9660 metadata cache             */
+/**************************************/
+
+// Copies the user data part of a sector read from the image
+class MetadataReadCallback: public IDEImage::Callback
+{
+public:
+    uint8_t *dest;
+    size_t skip;
+
+    virtual ssize_t read_callback(const uint8_t *data, size_t blocksize, size_t num_blocks) override
+    {
+        memcpy(dest, data + skip, 2048);
+        return num_blocks;
+    }
+
+    virtual ssize_t write_callback(uint8_t *data, size_t blocksize, size_t num_blocks, bool first_xfer, bool last_xfer) override
+    {
+        return -1;
+    }
+};
+
+// Read volume descriptors, root directory, path table and the directories
+// listed in path table until the configured number of sectors is used.
+// Path table lists parent directories before subdirectories, so the
+// directories closest to the root get cached first.
+void IDECDROMDevice::buildMetadataCache()
+{
+    m_metadata_cache.count = 0;
+    m_metadata_cache.hits = 0;
+    m_metadata_cache.misses = 0;
+
+    long max_count = ini_getl("IDE", "cd_metadata_cache", CDROM_METADATA_CACHE_SECTORS, CONFIGFILE);
+    m_metadata_cache.max_count = std::max<long>(0, std::min<long>(max_count, CDROM_METADATA_CACHE_MAX_SECTORS));
+    m_metadata_cache.data = m_image->reserve_buffer(m_metadata_cache.max_count * 2048);
+    if (!m_metadata_cache.data)
+    {
+        if (m_metadata_cache.max_count > 0) logmsg("---- Transfer buffer too small for metadata cache");
+        m_metadata_cache.max_count = 0;
+        return;
+    }
+
+    // Find first data track
+    int idx = 0;
+    while (idx < m_tracks.count && m_tracks.entries[idx].track_mode == CUETrack_AUDIO) idx++;
+    if (idx >= m_tracks.count)
+    {
+        releaseMetadataCache();
+        return;
+    }
+
+    // Volume descriptor set starts at sector 16 and ends with terminator descriptor
+    const uint8_t *pvd = nullptr;
+    uint32_t lba = m_tracks.entries[idx].data_start + 16;
+    for (int i = 0; i < 8; i++, lba++)
+    {
+        if (!pinMetadataSectors(lba, 1)) break;
+
+        const uint8_t *vd = findMetadataSector(lba);
+        if (memcmp(vd + 1, "CD001", 5) != 0) break;
+        if (vd[0] == 1 && !pvd) pvd = vd;
+        if (vd[0] == 255) break;
+    }
+
+    if (!pvd)
+    {
+        dbgmsg("---- No ISO9660 primary volume descriptor found, metadata cache not used");
+        releaseMetadataCache();
+        return;
+    }
+
+    // Root directory record is embedded in the primary volume descriptor
+    uint32_t root_lba = parse_le32(pvd + 158);
+    uint32_t root_len = parse_le32(pvd + 166);
+    pinMetadataSectors(root_lba, (root_len + 2047) / 2048);
+
+    // Type L path table
+    uint32_t pt_size = parse_le32(pvd + 132);
+    uint32_t pt_lba = parse_le32(pvd + 140);
+    uint32_t pt_sectors = (pt_size + 2047) / 2048;
+    if (pt_sectors > 0 && pinMetadataSectors(pt_lba, pt_sectors))
+    {
+        // Records can cross sector boundaries, parse only if the sectors are contiguous in RAM
+        const uint8_t *pt = findMetadataSector(pt_lba);
+        bool contiguous = true;
+        for (uint32_t i = 1; i < pt_sectors; i++)
+        {
+            contiguous = contiguous && (findMetadataSector(pt_lba + i) == pt + i * 2048);
+        }
+
+        uint32_t pos = 0;
+        bool first = true;
+        while (contiguous && pos + 8 <= pt_size)
+        {
+            uint8_t name_len = pt[pos];
+            if (name_len == 0) break;
+
+            uint32_t extent = parse_le32(pt + pos + 2);
+            pos += 8 + name_len + (name_len & 1);
+
+            if (first)
             {
-                buf[5] = 0x10;
+                // Root directory is already cached
+                first = false;
+                continue;
             }
+
+            // Directory size is given in its first entry
+            if (!pinMetadataSectors(extent, 1)) break;
+            uint32_t dir_sectors = (parse_le32(findMetadataSector(extent) + 10) + 2047) / 2048;
+            if (dir_sectors > 1 && !pinMetadataSectors(extent + 1, dir_sectors - 1)) break;
         }
-        lasttrack = *trackinfo;
+    }
 
-        formatRawTrackInfo(trackinfo, &buf[len], useBCD);
-        trackcount += 1;
-        len += 11;
+    logmsg("---- Cached ", m_metadata_cache.count, " ISO9660 metadata sectors");
+}
 
-        selectBinFileForTrack(trackinfo);
-        prev_capacity = m_image->capacity();
+// Return the reserved space to the image transfer buffer
+void IDECDROMDevice::releaseMetadataCache()
+{
+    if (m_metadata_cache.data && m_image)
+    {
+        m_image->reserve_buffer(0);
+    }
+    m_metadata_cache.data = nullptr;
+    m_metadata_cache.count = 0;
+    m_metadata_cache.max_count = 0;
+}
+
+// Read sectors from the image to the metadata cache.
+// Returns false if they do not all fit or cannot be read.
+bool IDECDROMDevice::pinMetadataSectors(uint32_t lba, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++, lba++)
+    {
+        if (findMetadataSector(lba)) continue;
+        if (m_metadata_cache.count >= m_metadata_cache.max_count) return false;
+
+        CUETrackInfo trackinfo = getTrackFromLBA(lba);
+        MetadataReadCallback callback;
+        callback.dest = m_metadata_cache.data + m_metadata_cache.count * 2048;
+        if (trackinfo.track_mode == CUETrack_MODE1_2048)
+            callback.skip = 0;
+        else if (trackinfo.track_mode == CUETrack_MODE1_2352)
+            callback.skip = 16;
+        else if (trackinfo.track_mode == CUETrack_MODE2_2352)
+            callback.skip = 24;
+        else
+            return false;
+
+        if (lba < trackinfo.data_start || !selectBinFileForTrack(&trackinfo)) return false;
+
+        uint64_t offset = trackinfo.file_offset + (uint64_t)(lba - trackinfo.data_start) * trackinfo.sector_length;
+        if (offset + trackinfo.sector_length > m_image->capacity() ||
+            !m_image->read(offset, trackinfo.sector_length, 1, &callback))
+        {
+            return false;
+        }
+
+        m_metadata_cache.lba[m_metadata_cache.count++] = lba;
     }
 
-    // First and last track numbers
-    buf[12] = firsttrack;
-    if (lasttrack.track_number != 0)
+    return true;
+}
+
+const uint8_t *IDECDROMDevice::findMetadataSector(uint32_t lba)
+{
+    for (int i = 0; i < m_metadata_cache.count; i++)
     {
-        buf[23] = lasttrack.track_number;
-        if (lasttrack.track_mode == CUETrack_AUDIO)
+        if (m_metadata_cache.lba[i] == lba)
         {
-            buf[16] = 0x10;
-            buf[27] = 0x10;
+            return m_metadata_cache.data + i * 2048;
         }
     }
+    return nullptr;
+}
 
-    // Leadout track position
-    if (useBCD) {
-        LBA2MSFBCD(getLeadOutLBA(&lasttrack), &buf[34], false);
-    } else {
-        LBA2MSF(getLeadOutLBA(&lasttrack), &buf[34], false);
+bool IDECDROMDevice::hasMetadataSectors(uint32_t lba, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (!findMetadataSector(lba + i)) return false;
     }
+    return true;
+}
 
-    // Correct the record length in header
-    uint16_t toclen = len - 2;
-    buf[0] = toclen >> 8;
-    buf[1] = toclen & 0xFF;
+// Send sectors from the metadata cache, hasMetadataSectors() must be checked first.
+// Returns false if the transfer fails or is interrupted.
+bool IDECDROMDevice::sendMetadataSectors(uint32_t lba, uint32_t count)
+{
+    uint32_t done = 0;
+    uint32_t start = millis();
+    while (done < count)
+    {
+        // Sectors that were read as one extent are consecutive in RAM
+        const uint8_t *data = findMetadataSector(lba + done);
+        uint32_t run = 1;
+        while (done + run < count && findMetadataSector(lba + done + run) == data + run * 2048)
+        {
+            run++;
+        }
 
-    atapi_send_data(buf, std::min<uint32_t>(allocationLength, len));
-    return atapi_cmd_ok();
+        platform_poll();
+        ssize_t status = atapi_send_data_async(data, 2048, run);
+        if (status < 0 || ide_phy_is_command_interrupted())
+        {
+            return false;
+        }
+        else if (status == 0 && (uint32_t)(millis() - start) > 10000)
+        {
+            logmsg("IDECDROMDevice::sendMetadataSectors() timeout");
+            return false;
+        }
+
+        done += status;
+    }
+
+    return true;
 }
 
+void IDECDROMDevice::logMetadataCacheStats()
+{
+    if (m_metadata_cache.hits + m_metadata_cache.misses > 0)
+    {
+        logmsg("ISO9660 metadata cache: ", (int)m_metadata_cache.hits, " hits, ",
+               (int)m_metadata_cache.misses, " misses, ",
+               (int)(m_metadata_cache.hits * 100 / (m_metadata_cache.hits + m_metadata_cache.misses)), "% hit rate");
+    }
+}
 
 /**************************************/
 /* CD-ROM audio playback              */
@@ -1391,6 +1667,7 @@ bool IDECDROMDevice::doReadCD(uint32_t lba, uint32_t length, uint8_t sector_type
         m_cd_read_format.sector_data_length = 2048;
         m_cd_read_format.add_fake_headers = false;
         m_cd_read_format.field_q_subchannel = false;
+        m_cd_read_format.field_raw_subchannel = false;
         m_cd_read_format.start_lba = lba;
         m_cd_read_format.sectors_done = 0;
 
@@ -1421,7 +1698,7 @@ bool IDECDROMDevice::doReadCD(uint32_t lba, uint32_t length, uint8_t sector_type
             m_cd_read_format.sector_data_length = 2048;
             m_cd_read_format.sector_length_out = 2048 + 304;
             m_cd_read_format.add_fake_headers = true;
-            dbgmsg("------ Host requested ECC data but image file lacks it, replacing with zeros");
+            dbgmsg("------ Host requested ECC data but image file lacks it, generating it");
         }
         else if (trackinfo.track_mode == CUETrack_MODE1_2352 && main_channel == 0x10)
         {
@@ -1463,25 +1740,82 @@ bool IDECDROMDevice::doReadCD(uint32_t lba, uint32_t length, uint8_t sector_type
             m_cd_read_format.field_q_subchannel = true;
             m_cd_read_format.sector_length_out += 16;
         }
+        else if (sub_channel == 1 && openSubchannelFile(&trackinfo))
+        {
+            // Raw P-W subchannel
+            m_cd_read_format.field_raw_subchannel = true;
+            m_cd_read_format.sector_length_out += 96;
+        }
         else if (sub_channel != 0)
         {
             dbgmsg("---- Unsupported subchannel request");
             return atapi_cmd_error(ATAPI_SENSE_ILLEGAL_REQ, ATAPI_ASC_INVALID_FIELD);
         }
 
-        if (m_cd_read_format.sector_length_file == 0)
+        if (m_cd_read_format.sector_length_out == 2048 &&
+            m_cd_read_format.sector_data_length == 2048 &&
+            lba >= trackinfo.data_start &&
+            m_metadata_cache.count > 0)
         {
-            // No actual data needed, just send headers
-            read_callback(nullptr, 0, length);
+            if (hasMetadataSectors(lba, length))
+            {
+                m_metadata_cache.hits++;
+                if (!sendMetadataSectors(lba, length))
+                {
+                    return atapi_cmd_error(ATAPI_SENSE_ABORTED_CMD, 0);
+                }
+                length_done += length;
+                lba += length;
+                continue;
+            }
+            else
+            {
+                m_metadata_cache.misses++;
+            }
         }
-        else if (m_image->read(offset, m_cd_read_format.sector_length_file, length, this))
+
+        m_cd_read_format.total_sectors = length;
+        m_cd_read_format.sectors_staged = 0;
+
+        // With subchannel data the read is split into chunks that fit in subchannel buffer
+        uint32_t chunk = m_cd_read_format.field_raw_subchannel ? CDROM_SUBCHANNEL_BUFFER_SECTORS : length;
+        for (uint32_t pos = 0; pos < length; pos += chunk)
         {
-            // Read callback does the work
+            uint32_t count = std::min(chunk, length - pos);
+
+            if (m_cd_read_format.field_raw_subchannel &&
+                !readSubchannel(offset / trackinfo.sector_length + pos, pos, count))
+            {
+                dbgmsg("-- CD subchannel read failed, starting offset ", (int)offset, " length ", (int)length);
+                return atapi_cmd_error(ATAPI_SENSE_MEDIUM_ERROR, 0);
+            }
+
+            if (m_cd_read_format.sector_length_file == 0)
+            {
+                // No actual data needed, just send headers
+                size_t headers_done = 0;
+                while (headers_done < count && !ide_phy_is_command_interrupted())
+                {
+                    ssize_t status = read_callback(nullptr, 0, count - headers_done);
+                    if (status < 0) return atapi_cmd_error(ATAPI_SENSE_ABORTED_CMD, 0);
+                    headers_done += status;
+                }
+            }
+            else if (m_image->read(offset + (uint64_t)pos * m_cd_read_format.sector_length_file,
+                                   m_cd_read_format.sector_length_file, count, this))
+            {
+                // Read callback does the work
+            }
+            else
+            {
+                dbgmsg("-- CD read failed, starting offset ", (int)offset, " length ", (int)length);
+                return atapi_cmd_error(ATAPI_SENSE_MEDIUM_ERROR, 0);
+            }
         }
-        else
+
+        if (!flush_read_staging())
         {
-            dbgmsg("-- CD read failed, starting offset ", (int)offset, " length ", (int)length);
-            return atapi_cmd_error(ATAPI_SENSE_MEDIUM_ERROR, 0);
+            return atapi_cmd_error(ATAPI_SENSE_ABORTED_CMD, 0);
         }
 
         length_done += length;
@@ -1514,13 +1848,29 @@ ssize_t IDECDROMDevice::read_callback(const uint8_t *data, size_t blocksize, siz
         return atapi_send_data_async(data, blocksize, num_blocks);
     }
 
-    // Reformat sector data for transmission
-    assert(sizeof(m_buffer) >= m_cd_read_format.sector_length_out);
+    // Reformat sector data for transmission.
+    // Multiple sectors are packed to staging buffer so that they can be sent as one block.
     size_t blocks_done = 0;
-    while (blocks_done < num_blocks && atapi_send_data_is_ready(m_cd_read_format.sector_length_out))
+    while (blocks_done < num_blocks)
     {
-        uint8_t *buf = m_buffer.bytes;
-        uint32_t current_lba = m_cd_read_format.start_lba + m_cd_read_format.sectors_done;
+        if (m_cd_read_format.sectors_staged > 0 &&
+            m_cd_read_format.sectors_staged == read_staging_target())
+        {
+            ssize_t status = send_read_staging();
+            if (status < 0)
+            {
+                return -1;
+            }
+            else if (status == 0)
+            {
+                // Hardware buffer is now full, return from callback
+                break;
+            }
+        }
+
+        uint8_t *sector = m_read_staging.bytes + m_cd_read_format.sectors_staged * m_cd_read_format.sector_length_out;
+        uint8_t *buf = sector;
+        uint32_t current_lba = m_cd_read_format.start_lba + m_cd_read_format.sectors_done + m_cd_read_format.sectors_staged;
 
         if (m_cd_read_format.add_fake_headers)
         {
@@ -1548,8 +1898,8 @@ ssize_t IDECDROMDevice::read_callback(const uint8_t *data, size_t blocksize, siz
 
         if (m_cd_read_format.add_fake_headers)
         {
-            // 288 bytes of ECC
-            memset(buf, 0, 288);
+            // 4 bytes EDC, 8 zero bytes and 276 bytes of ECC
+            cdrom_generate_mode1_ecc(sector);
             buf += 288;
         }
 
@@ -1570,28 +1920,150 @@ ssize_t IDECDROMDevice::read_callback(const uint8_t *data, size_t blocksize, siz
             *buf++ = 0; // No P subchannel
         }
 
-        assert(buf == m_buffer.bytes + m_cd_read_format.sector_length_out);
-        ssize_t status = atapi_send_data_async(m_buffer.bytes, m_cd_read_format.sector_length_out, 1);
+        if (m_cd_read_format.field_raw_subchannel)
+        {
+            uint32_t idx = m_cd_read_format.sectors_done + m_cd_read_format.sectors_staged - m_subchannel.first;
+            assert(idx < m_subchannel.count);
+            interleaveSubchannel(&m_subchannel.data[idx * 96], buf);
+            buf += 96;
+        }
+
+        assert(buf == sector + m_cd_read_format.sector_length_out);
+        m_cd_read_format.sectors_staged += 1;
+        blocks_done += 1;
+    }
+
+    if (m_cd_read_format.sectors_staged == read_staging_target())
+    {
+        // Start sending immediately if possible, the rest will be sent on next call
+        // or from flush_read_staging() after last sector.
+        if (send_read_staging() < 0) return -1;
+    }
+
+    return blocks_done;
+}
+
+// Number of sectors to collect to staging buffer before sending them
+uint32_t IDECDROMDevice::read_staging_target()
+{
+    size_t max_bytes = std::min<size_t>({m_phy_caps.max_blocksize, m_atapi_state.bytes_req, sizeof(m_read_staging)});
+    uint32_t per_block = std::max<size_t>(max_bytes / m_cd_read_format.sector_length_out, 1);
+    uint32_t remaining = m_cd_read_format.total_sectors - m_cd_read_format.sectors_done;
+    return std::min(per_block, remaining);
+}
+
+// Send staged sectors if hardware is ready to accept them.
+// Returns 1 if data was sent, 0 if hardware is busy and -1 on error.
+ssize_t IDECDROMDevice::send_read_staging()
+{
+    size_t length = m_cd_read_format.sectors_staged * m_cd_read_format.sector_length_out;
+    if (!atapi_send_data_is_ready(length))
+    {
+        return 0;
+    }
+
+    ssize_t status = atapi_send_data_async(m_read_staging.bytes, length, 1);
+    if (status < 0)
+    {
+        dbgmsg("-- IDECDROMDevice atapi_send_data failed, length ", (int)length);
+        return -1;
+    }
+    else if (status > 0)
+    {
+        m_cd_read_format.sectors_done += m_cd_read_format.sectors_staged;
+        m_cd_read_format.sectors_staged = 0;
+    }
 
-        if (status < 0)
+    return status;
+}
+
+// Send any sectors left in staging buffer at the end of a read
+bool IDECDROMDevice::flush_read_staging()
+{
+    uint32_t start = millis();
+    while (m_cd_read_format.sectors_staged > 0)
+    {
+        platform_poll();
+        if (send_read_staging() < 0)
         {
-            dbgmsg("-- IDECDROMDevice atapi_send_data failed, length ", (int)m_cd_read_format.sector_length_out);
-            return -1;
+            return false;
         }
-        else if (status == 0)
+
+        if ((uint32_t)(millis() - start) > 10000)
         {
-            // Hardware buffer is now full, return from callback
-            break;
+            logmsg("IDECDROMDevice::flush_read_staging() timeout");
+            return false;
         }
-        else
+
+        if (ide_phy_is_command_interrupted())
         {
-            // Block written to hardware buffer successfully
-            m_cd_read_format.sectors_done += 1;
-            blocks_done += 1;
+            dbgmsg("IDECDROMDevice::flush_read_staging() interrupted");
+            m_cd_read_format.sectors_staged = 0;
+            return false;
         }
     }
 
-    return blocks_done;
+    return true;
+}
+
+// Open the .sub file with the same name as the file of the track.
+// Returns false if there is no subchannel data for the track.
+bool IDECDROMDevice::openSubchannelFile(const CUETrackInfo *track)
+{
+    if (m_subchannel.file_index == (int)track->file_index)
+    {
+        return m_subchannel.available;
+    }
+
+    m_subchannel.file.close();
+    m_subchannel.file_index = track->file_index;
+    m_subchannel.available = false;
+    m_subchannel.count = 0;
+
+    char subname[MAX_FILE_PATH + 1];
+    const char *name = m_image->is_folder() ? track->filename : m_filename;
+    strlcpy(subname, name, sizeof(subname));
+    char *ext = strrchr(subname, '.');
+    if (ext) *ext = '\0';
+    if (strlcat(subname, ".sub", sizeof(subname)) >= sizeof(subname))
+    {
+        return false;
+    }
+
+    IDEImageFile *imagefile = (IDEImageFile*)m_image;
+    if (m_subchannel.file.open(imagefile->get_folder(), subname, O_RDONLY))
+    {
+        logmsg("---- Using subchannel data from ", subname);
+        m_subchannel.available = true;
+    }
+
+    return m_subchannel.available;
+}
+
+// Read subchannel data for count sectors starting from sector file_sector of
+// the track file. Sectors beyond the end of .sub file get zero subchannel data.
+bool IDECDROMDevice::readSubchannel(uint64_t file_sector, uint32_t first, uint32_t count)
+{
+    assert(count <= CDROM_SUBCHANNEL_BUFFER_SECTORS);
+    uint64_t pos = file_sector * 96;
+    uint64_t size = m_subchannel.file.size();
+    uint32_t len = count * 96;
+    uint32_t avail = (pos < size) ? std::min<uint64_t>(len, size - pos) : 0;
+
+    // Sequential reads continue from the current position without seeking
+    if (avail > 0)
+    {
+        if ((m_subchannel.file.curPosition() != pos && !m_subchannel.file.seekSet(pos)) ||
+            m_subchannel.file.read(m_subchannel.data, avail) != (int)avail)
+        {
+            return false;
+        }
+    }
+
+    memset(m_subchannel.data + avail, 0, len - avail);
+    m_subchannel.first = first;
+    m_subchannel.count = count;
+    return true;
 }
 
 bool IDECDROMDevice::loadAndValidateCueSheet(FsFile *dir, const char *cuesheetname, CUETrackInfo &first_track, CUETrackInfo &last_track)
@@ -1707,6 +2179,7 @@ uint64_t IDECDROMDevice::capacity_lba()
 void IDECDROMDevice::eject_media()
 {
     doStopAudio();
+    m_toc_cache.valid = false;
     set_esn_event(esn_event_t::MMediaRemoval);
     IDEATAPIDevice::eject_media();
 }
@@ -1906,60 +2379,103 @@ uint32_t IDECDROMDevice::getLeadOutLBA(const CUETrackInfo* lasttrack)
     }
 }
 
-// Fetch track info based on LBA
-CUETrackInfo IDECDROMDevice::getTrackFromLBA(uint32_t lba)
+// Parse the CUE sheet once and store track layout for getTrackFromLBA()
+bool IDECDROMDevice::buildTrackTable()
 {
-
-    if (lba >= m_cached_track_result.track_start && lba < m_cached_end_lba)
-        return m_cached_track_result;
-    else
-        clear_cached_track_info();
-
-    CUETrackInfo result = {};
-    const CUETrackInfo *tmptrack;
+    const CUETrackInfo *trackinfo;
     uint64_t prev_capacity = 0;
 
+    m_tracks.count = 0;
+    m_tracks.filenames_len = 0;
+
     m_cueparser.restart();
-    while ((tmptrack = m_cueparser.next_track(prev_capacity)) != NULL)
+    while ((trackinfo = m_cueparser.next_track(prev_capacity)) != NULL)
     {
-        if (tmptrack->track_start <= lba)
+        if (m_tracks.count >= CDROM_MAX_TRACKS)
         {
-            result = *tmptrack;
+            logmsg("---- WARNING: CUE sheet has more than ", (int)CDROM_MAX_TRACKS, " tracks, ignoring rest");
+            break;
         }
-        else
+
+        cdrom_track_entry_t *entry = &m_tracks.entries[m_tracks.count];
+        entry->track_start = trackinfo->track_start;
+        entry->data_start = trackinfo->data_start;
+        entry->file_offset = trackinfo->file_offset;
+        entry->file_index = trackinfo->file_index;
+        entry->sector_length = trackinfo->sector_length;
+        entry->unstored_pregap_length = trackinfo->unstored_pregap_length;
+        entry->track_number = trackinfo->track_number;
+        entry->track_mode = trackinfo->track_mode;
+        entry->file_mode = trackinfo->file_mode;
+        entry->filename_pos = -1;
+
+        if (trackinfo->filename[0] != '\0')
         {
-            break;
+            // Tracks in the same file share the filename
+            if (m_tracks.count > 0 && m_tracks.entries[m_tracks.count - 1].file_index == entry->file_index)
+            {
+                entry->filename_pos = m_tracks.entries[m_tracks.count - 1].filename_pos;
+            }
+            else
+            {
+                size_t len = strlen(trackinfo->filename) + 1;
+                if (m_tracks.filenames_len + len > sizeof(m_tracks.filenames))
+                {
+                    logmsg("---- Track filenames exceed ", (int)sizeof(m_tracks.filenames), " bytes, cannot load image");
+                    m_tracks.count = 0;
+                    return false;
+                }
+
+                memcpy(m_tracks.filenames + m_tracks.filenames_len, trackinfo->filename, len);
+                entry->filename_pos = m_tracks.filenames_len;
+                m_tracks.filenames_len += len;
+            }
         }
 
-        selectBinFileForTrack(tmptrack);
-        prev_capacity = m_image->capacity();
-    }
-    m_cached_track_result = result;
-    if (tmptrack != NULL)
-    {
-        m_cached_end_lba = tmptrack->track_start;
-    }
-    else
-    {
+        if (m_tracks.count > 0)
+        {
+            m_tracks.entries[m_tracks.count - 1].end_lba = entry->track_start;
+        }
 
-        if (selectBinFileForTrack(&m_cached_track_result))
+        // End of last track is determined by the size of its file
+        entry->end_lba = entry->data_start;
+        if (selectBinFileForTrack(trackinfo))
         {
-            uint64_t filesize = m_image->capacity();
-            if (m_cached_track_result.file_offset <= filesize)
+            prev_capacity = m_image->capacity();
+            if (entry->file_offset <= prev_capacity && entry->sector_length > 0)
             {
-                m_cached_end_lba =  ((filesize - m_cached_track_result.file_offset) / m_cached_track_result.sector_length)
-                                    + m_cached_track_result.data_start;
+                entry->end_lba = (prev_capacity - entry->file_offset) / entry->sector_length + entry->data_start;
             }
         }
+
+        m_tracks.count++;
     }
-    return result;
+
+    dbgmsg("---- Track table built with ", m_tracks.count, " tracks");
+    return m_tracks.count > 0;
+}
+
+// Fetch track info based on LBA
+CUETrackInfo IDECDROMDevice::getTrackFromLBA(uint32_t lba)
+{
+    int idx = cdrom_track_index(&m_tracks, lba);
+    if (idx < 0)
+    {
+        CUETrackInfo result = {};
+        return result;
+    }
+
+    return cdrom_track_info(&m_tracks, idx);
 }
 
 void IDECDROMDevice::clear_cached_track_info()
 {
-    m_cached_end_lba = 0;
+    logMetadataCacheStats();
+    releaseMetadataCache();
     m_cached_capacity_lba = 0;
-    memset(&m_cached_track_result, 0, sizeof(m_cached_track_result));
+    m_toc_cache.valid = false;
+    m_tracks.count = 0;
+    m_tracks.filenames_len = 0;
 }
 
 // Check if we need to switch the data .bin file when track changes.
@@ -28,8 +28,34 @@
 #pragma once
 
 #include "ide_atapi.h"
+#include "ide_cdrom_tracks.h"
 #include <scp/SharedCUEParser.h>
 
+// Size of the buffer for packing reformatted CD sectors to larger blocks.
+// Must fit at least one raw sector with subchannel data.
+#ifndef CDROM_READ_STAGING_SIZE
+#define CDROM_READ_STAGING_SIZE 4096
+#endif
+
+// Default and maximum number of 2048-byte ISO9660 metadata sectors kept in RAM,
+// set with cd_metadata_cache in zuluide.ini. The space is taken from the
+// image transfer buffer, so memory is used only when the cache is enabled.
+#ifndef CDROM_METADATA_CACHE_SECTORS
+#define CDROM_METADATA_CACHE_SECTORS 8
+#endif
+#ifndef CDROM_METADATA_CACHE_MAX_SECTORS
+#define CDROM_METADATA_CACHE_MAX_SECTORS 16
+#endif
+
+// Number of sectors of .sub file data read at a time
+#ifndef CDROM_SUBCHANNEL_BUFFER_SECTORS
+#define CDROM_SUBCHANNEL_BUFFER_SECTORS 32
+#endif
+
+// Buffer sizes for formatted TOC responses: header, track descriptors and lead-out
+#define CDROM_TOC_RESPONSE_SIZE (4 + (CDROM_MAX_TRACKS + 1) * 8)
+#define CDROM_FULL_TOC_RESPONSE_SIZE (37 + CDROM_MAX_TRACKS * 11)
+
 class IDECDROMDevice: public IDEATAPIDevice
 {
 public:
@@ -116,11 +142,38 @@ protected:
         int sector_data_length; // Number of bytes of sector data to copy
         bool add_fake_headers;
         bool field_q_subchannel;
+        bool field_raw_subchannel; // P-W subchannel from .sub file
         CUETrackInfo trackinfo;
         uint32_t start_lba;
-        uint32_t sectors_done;
+        uint32_t sectors_done; // Sectors sent to host
+        uint32_t sectors_staged; // Sectors waiting in m_read_staging
+        uint32_t total_sectors; // Length of current read
     } m_cd_read_format;
 
+    // Reformatted sectors are packed here to send as many as fit in one PHY block
+    union {
+        uint32_t dword[CDROM_READ_STAGING_SIZE / 4];
+        uint8_t bytes[CDROM_READ_STAGING_SIZE];
+    } m_read_staging;
+    uint32_t read_staging_target();
+    ssize_t send_read_staging();
+    bool flush_read_staging();
+
+    // Subchannel data from .sub file next to the track file, as stored by CloneCD.
+    // It has 96 bytes per sector, with 12 bytes for each of channels P to W.
+    // Reads requesting subchannel data are done in chunks, reading the
+    // subchannel data of each chunk in one go before its main channel data.
+    struct {
+        FsFile file;
+        int file_index; // Track file the .sub file belongs to, -1 if none open
+        bool available;
+        uint32_t first; // Sector of buffered data, relative to m_cd_read_format.start_lba
+        uint32_t count;
+        uint8_t data[CDROM_SUBCHANNEL_BUFFER_SECTORS * 96];
+    } m_subchannel;
+    bool openSubchannelFile(const CUETrackInfo *track);
+    bool readSubchannel(uint64_t file_sector, uint32_t first, uint32_t count);
+
     // Read handling and sector format translation if needed
     virtual bool doRead(uint32_t lba, uint32_t transfer_len) override;
     bool doReadCD(uint32_t lba, uint32_t length, uint8_t sector_type,
@@ -134,10 +187,49 @@ protected:
     uint32_t getLeadOutLBA(const CUETrackInfo* lasttrack);
     CUETrackInfo getTrackFromLBA(uint32_t lba);
     void clear_cached_track_info();
-    CUETrackInfo m_cached_track_result;
-    uint32_t m_cached_end_lba;
     uint64_t m_cached_capacity_lba;
 
+    // Track layout of the loaded image, built once in set_image() so that
+    // LBA lookups on the read path do not need to parse the CUE sheet.
+    // Also used by audio playback.
+    cdrom_track_table_t m_tracks;
+    bool buildTrackTable();
+
+    // READ TOC, READ DISC INFORMATION and session info responses,
+    // formatted from the track table when the image is loaded.
+    // Invalidated when media is ejected or changed and rebuilt on next use.
+    struct {
+        bool valid;
+        uint16_t toc_len;
+        uint8_t toc_lba[CDROM_TOC_RESPONSE_SIZE];
+        uint8_t toc_msf[CDROM_TOC_RESPONSE_SIZE];
+        uint16_t full_toc_len;
+        uint8_t full_toc[CDROM_FULL_TOC_RESPONSE_SIZE];
+        uint8_t full_toc_bcd[CDROM_FULL_TOC_RESPONSE_SIZE];
+        uint8_t session_info[12];
+        uint8_t disc_info[34];
+    } m_toc_cache;
+    bool buildTocCache();
+
+    // ISO9660 volume descriptors, path table and directory extents of the
+    // first data track, read when the image is loaded so that directory
+    // browsing on the host does not wait for SD card access.
+    struct {
+        uint32_t lba[CDROM_METADATA_CACHE_MAX_SECTORS];
+        uint8_t *data; // Reserved from the image transfer buffer, max_count * 2048 bytes
+        int count;
+        int max_count;
+        uint32_t hits;
+        uint32_t misses;
+    } m_metadata_cache;
+    void buildMetadataCache();
+    void releaseMetadataCache();
+    bool pinMetadataSectors(uint32_t lba, uint32_t count);
+    const uint8_t *findMetadataSector(uint32_t lba);
+    bool hasMetadataSectors(uint32_t lba, uint32_t count);
+    bool sendMetadataSectors(uint32_t lba, uint32_t count);
+    void logMetadataCacheStats();
+
     int m_selected_file_index;
     // If the .cue file has data split across multiple files,
     // this function will reopen m_imagefile when track is changed.
@@ -0,0 +1,117 @@
+/**
+ * ZuluIDE™ - Copyright (c) 2023 Rabbit Hole Computing™
+ *
+ * ZuluIDE™ firmware is licensed under the GPL version 3 or any later version.
+ *
+ * https://www.gnu.org/licenses/gpl-3.0.html
+ * ----
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Under Section 7 of GPL version 3, you are granted additional
+ * permissions described in the ZuluIDE Hardware Support Library Exception
+ * (GPL-3.0_HSL_Exception.md), as published by Rabbit Hole Computing™.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#include "ide_cdrom_ecc.h"
+#include <string.h>
+
+// Mode 1 sector layout
+#define SECTOR_HEADER_OFFSET 0x00C
+#define SECTOR_EDC_OFFSET 0x810
+#define SECTOR_ZERO_OFFSET 0x814
+#define SECTOR_ECC_P_OFFSET 0x81C
+#define SECTOR_ECC_Q_OFFSET 0x8C8
+
+// Lookup tables are kept in RAM because flash access through XIP cache
+// is too slow for the per-byte lookups.
+static bool g_tables_initialized;
+static uint32_t g_edc_table[256];
+static uint8_t g_ecc_f_table[256]; // Multiplication by alpha in GF(2^8)
+static uint8_t g_ecc_b_table[256]; // Division by (1 + alpha) in GF(2^8)
+
+static void init_tables()
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        // GF(2^8) with primitive polynomial x^8 + x^4 + x^3 + x^2 + 1
+        uint32_t j = (i << 1) ^ ((i & 0x80) ? 0x11D : 0);
+        g_ecc_f_table[i] = (uint8_t)j;
+        g_ecc_b_table[i ^ j] = (uint8_t)i;
+
+        // Bit-reversed form of the EDC polynomial
+        uint32_t edc = i;
+        for (int k = 0; k < 8; k++)
+        {
+            edc = (edc >> 1) ^ ((edc & 1) ? 0xD8018001 : 0);
+        }
+        g_edc_table[i] = edc;
+    }
+
+    g_tables_initialized = true;
+}
+
+uint32_t cdrom_edc(const uint8_t *data, uint32_t length)
+{
+    if (!g_tables_initialized) init_tables();
+
+    uint32_t edc = 0;
+    while (length--)
+    {
+        edc = (edc >> 8) ^ g_edc_table[(edc ^ *data++) & 0xFF];
+    }
+    return edc;
+}
+
+// Compute one set of RS-PC parity bytes.
+// The 2064 bytes from header onwards are viewed as 16-bit words in a matrix.
+// P parity is computed over 86 columns of 24 words, Q parity over 52 diagonals of 43 words.
+// MSB and LSB of the words form separate codewords, which is why major index
+// alternates between them.
+static void compute_ecc(const uint8_t *src, uint32_t major_count, uint32_t minor_count,
+                        uint32_t major_mult, uint32_t minor_inc, uint8_t *dest)
+{
+    uint32_t size = major_count * minor_count;
+    for (uint32_t major = 0; major < major_count; major++)
+    {
+        uint32_t index = (major >> 1) * major_mult + (major & 1);
+        uint8_t ecc_a = 0;
+        uint8_t ecc_b = 0;
+        for (uint32_t minor = 0; minor < minor_count; minor++)
+        {
+            uint8_t value = src[index];
+            index += minor_inc;
+            if (index >= size) index -= size;
+            ecc_a ^= value;
+            ecc_b ^= value;
+            ecc_a = g_ecc_f_table[ecc_a];
+        }
+        ecc_a = g_ecc_b_table[g_ecc_f_table[ecc_a] ^ ecc_b];
+        dest[major] = ecc_a;
+        dest[major + major_count] = ecc_a ^ ecc_b;
+    }
+}
+
+void cdrom_generate_mode1_ecc(uint8_t *sector)
+{
+    uint32_t edc = cdrom_edc(sector, SECTOR_EDC_OFFSET);
+    sector[SECTOR_EDC_OFFSET + 0] = (uint8_t)(edc >> 0);
+    sector[SECTOR_EDC_OFFSET + 1] = (uint8_t)(edc >> 8);
+    sector[SECTOR_EDC_OFFSET + 2] = (uint8_t)(edc >> 16);
+    sector[SECTOR_EDC_OFFSET + 3] = (uint8_t)(edc >> 24);
+    memset(sector + SECTOR_ZERO_OFFSET, 0, SECTOR_ECC_P_OFFSET - SECTOR_ZERO_OFFSET);
+
+    // Q parity covers the P parity bytes, so P must be computed first
+    compute_ecc(sector + SECTOR_HEADER_OFFSET, 86, 24, 2, 86, sector + SECTOR_ECC_P_OFFSET);
+    compute_ecc(sector + SECTOR_HEADER_OFFSET, 52, 43, 86, 88, sector + SECTOR_ECC_Q_OFFSET);
+}
@@ -0,0 +1,38 @@
+/**
+ * ZuluIDE™ - Copyright (c) 2023 Rabbit Hole Computing™
+ *
+ * ZuluIDE™ firmware is licensed under the GPL version 3 or any later version.
+ *
+ * https://www.gnu.org/licenses/gpl-3.0.html
+ * ----
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Under Section 7 of GPL version 3, you are granted additional
+ * permissions described in the ZuluIDE Hardware Support Library Exception
+ * (GPL-3.0_HSL_Exception.md), as published by Rabbit Hole Computing™.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+// Error detection and correction codes of CD-ROM data sectors, ECMA-130 Annex A and B.
+// Used to generate complete raw sectors from images that only store user data.
+
+#pragma once
+
+#include <stdint.h>
+
+// Compute EDC (CRC32 with polynomial x^32 + x^31 + x^16 + x^15 + x^4 + x^3 + x + 1)
+uint32_t cdrom_edc(const uint8_t *data, uint32_t length);
+
+// Fill in EDC, zero area and P/Q parity of a 2352-byte Mode 1 sector.
+// Sync pattern, header and 2048 bytes of user data must already be present.
+void cdrom_generate_mode1_ecc(uint8_t *sector);
@@ -0,0 +1,69 @@
+/**
+ * ZuluIDE™ - Copyright (c) 2025 Rabbit Hole Computing™
+ *
+ * ZuluIDE™ firmware is licensed under the GPL version 3 or any later version.
+ *
+ * https://www.gnu.org/licenses/gpl-3.0.html
+ * ----
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Under Section 7 of GPL version 3, you are granted additional
+ * permissions described in the ZuluIDE Hardware Support Library Exception
+ * (GPL-3.0_HSL_Exception.md), as published by Rabbit Hole Computing™.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#include "ide_cdrom_tracks.h"
+#include <string.h>
+
+int cdrom_track_index(const cdrom_track_table_t *table, uint32_t lba)
+{
+    if (table->count == 0 || lba < table->entries[0].track_start)
+    {
+        return -1;
+    }
+
+    int lo = 0;
+    int hi = table->count;
+    while (hi - lo > 1)
+    {
+        int mid = (lo + hi) / 2;
+        if (table->entries[mid].track_start <= lba)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+CUETrackInfo cdrom_track_info(const cdrom_track_table_t *table, int idx)
+{
+    CUETrackInfo result = {};
+    const cdrom_track_entry_t *entry = &table->entries[idx];
+    result.track_start = entry->track_start;
+    result.data_start = entry->data_start;
+    result.file_offset = entry->file_offset;
+    result.file_index = entry->file_index;
+    result.sector_length = entry->sector_length;
+    result.unstored_pregap_length = entry->unstored_pregap_length;
+    result.track_number = entry->track_number;
+    result.track_mode = (CUETrackMode)entry->track_mode;
+    result.file_mode = (CUEFileMode)entry->file_mode;
+    if (entry->filename_pos >= 0)
+    {
+        strncpy(result.filename, table->filenames + entry->filename_pos, sizeof(result.filename) - 1);
+    }
+
+    return result;
+}
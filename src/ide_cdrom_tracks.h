@@ -0,0 +1,73 @@
+/**
+ * ZuluIDE™ - Copyright (c) 2025 Rabbit Hole Computing™
+ *
+ * ZuluIDE™ firmware is licensed under the GPL version 3 or any later version.
+ *
+ * https://www.gnu.org/licenses/gpl-3.0.html
+ * ----
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Under Section 7 of GPL version 3, you are granted additional
+ * permissions described in the ZuluIDE Hardware Support Library Exception
+ * (GPL-3.0_HSL_Exception.md), as published by Rabbit Hole Computing™.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+// Compact track layout of a CD image, built once from the CUE sheet when the
+// image is loaded. Shared read-only by the CD-ROM device and audio playback,
+// so that LBA lookups do not need to parse the CUE sheet.
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <CUEParser.h>
+
+// Maximum number of tracks kept in the track lookup table
+#ifndef CDROM_MAX_TRACKS
+#define CDROM_MAX_TRACKS 99
+#endif
+
+// Space for .bin filenames of the tracks in the track lookup table
+#ifndef CDROM_TRACK_FILENAME_POOL_SIZE
+#define CDROM_TRACK_FILENAME_POOL_SIZE 4096
+#endif
+
+struct cdrom_track_entry_t {
+    uint32_t track_start;
+    uint32_t data_start;
+    uint32_t end_lba; // Start of next track, or end of data for last track
+    uint64_t file_offset;
+    uint32_t file_index;
+    uint32_t sector_length;
+    uint32_t unstored_pregap_length;
+    int16_t filename_pos; // Offset in filenames, or -1 if no filename
+    uint8_t track_number;
+    uint8_t track_mode;
+    uint8_t file_mode;
+};
+
+// Entries are sorted by track_start
+struct cdrom_track_table_t {
+    cdrom_track_entry_t entries[CDROM_MAX_TRACKS];
+    int count;
+    char filenames[CDROM_TRACK_FILENAME_POOL_SIZE];
+    size_t filenames_len;
+};
+
+// Index of the last track starting at or before lba, or -1 if there is none.
+// LBAs beyond the end of the disc map to the last track.
+int cdrom_track_index(const cdrom_track_table_t *table, uint32_t lba);
+
+// Convert track table entry back to the format used by CUE parser
+CUETrackInfo cdrom_track_info(const cdrom_track_table_t *table, int idx);
@@ -0,0 +1,260 @@
+/**
+ * ZuluIDE™ - Copyright (c) 2023 Rabbit Hole Computing™
+ *
+ * ZuluIDE™ firmware is licensed under the GPL version 3 or any later version.
+ *
+ * https://www.gnu.org/licenses/gpl-3.0.html
+ * ----
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Under Section 7 of GPL version 3, you are granted additional
+ * permissions described in the ZuluIDE Hardware Support Library Exception
+ * (GPL-3.0_HSL_Exception.md), as published by Rabbit Hole Computing™.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#include "ide_cso.h"
+#include "ZuluIDE.h"
+#include "ZuluIDE_log.h"
+#include <string.h>
+#include <uzlib.h>
+#include <algorithm>
+
+#define CSO_HEADER_SIZE 24
+#define CSO_INDEX_PLAIN 0x80000000
+
+// Block cache and working buffers, placed in the work area given to open()
+struct cso_cache_t {
+    uint32_t block[CSO_CACHE_BLOCKS];
+    uint32_t last_used[CSO_CACHE_BLOCKS];
+    bool valid[CSO_CACHE_BLOCKS];
+    uint32_t counter;
+    uint8_t data[CSO_CACHE_BLOCKS][CSO_MAX_BLOCK_SIZE];
+
+    // Compressed data of the block being decoded
+    uint8_t compressed[CSO_MAX_BLOCK_SIZE];
+
+    // Window of the block index
+    uint32_t index[CSO_INDEX_CACHE_ENTRIES];
+    uint32_t index_start;
+    uint32_t index_count;
+};
+
+static uint32_t read_le32(const uint8_t *src)
+{
+    return ((uint32_t)src[3] << 24) | ((uint32_t)src[2] << 16) | ((uint32_t)src[1] << 8) | src[0];
+}
+
+CSOReader::CSOReader()
+{
+    m_open = false;
+    m_cache = nullptr;
+    m_total_bytes = 0;
+    m_block_size = 0;
+    m_num_blocks = 0;
+    m_index_shift = 0;
+    memset(&m_stats, 0, sizeof(m_stats));
+}
+
+size_t CSOReader::work_size()
+{
+    return sizeof(cso_cache_t);
+}
+
+bool CSOReader::open(FsFile *file, uint8_t *work)
+{
+    close();
+
+    uint8_t header[CSO_HEADER_SIZE];
+    if (!file->seek(0) || file->read(header, sizeof(header)) != sizeof(header) ||
+        memcmp(header, "CISO", 4) != 0)
+    {
+        return false;
+    }
+
+    uint64_t total_bytes = read_le32(&header[8]) | ((uint64_t)read_le32(&header[12]) << 32);
+    uint32_t block_size = read_le32(&header[16]);
+    uint8_t version = header[20];
+
+    if (version > 1 || block_size == 0 || block_size > CSO_MAX_BLOCK_SIZE || total_bytes == 0)
+    {
+        logmsg("-- Unsupported CSO image: version ", (int)version, ", block size ", (int)block_size);
+        return false;
+    }
+
+    m_total_bytes = total_bytes;
+    m_block_size = block_size;
+    m_num_blocks = (total_bytes + block_size - 1) / block_size;
+    m_index_shift = header[21];
+    memset(&m_stats, 0, sizeof(m_stats));
+    m_cache = (cso_cache_t*)work;
+    memset(m_cache, 0, sizeof(cso_cache_t));
+    uzlib_init();
+    m_open = true;
+
+    logmsg("-- Compressed CSO image, ", (int)(m_total_bytes / 1024), " kB in ", (int)m_num_blocks,
+           " blocks of ", (int)m_block_size, " bytes");
+    return true;
+}
+
+void CSOReader::close()
+{
+    if (m_open)
+    {
+        log_stats();
+    }
+
+    m_open = false;
+    m_cache = nullptr;
+    m_total_bytes = 0;
+}
+
+bool CSOReader::read(FsFile *file, uint64_t pos, uint8_t *dest, size_t len)
+{
+    if (!m_open || pos + len > m_total_bytes) return false;
+
+    while (len > 0)
+    {
+        uint32_t block = pos / m_block_size;
+        uint32_t offset = pos % m_block_size;
+        const uint8_t *data = get_block(file, block);
+        if (!data) return false;
+
+        size_t count = std::min<size_t>(len, m_block_size - offset);
+        memcpy(dest, data + offset, count);
+        dest += count;
+        pos += count;
+        len -= count;
+    }
+
+    return true;
+}
+
+bool CSOReader::get_block_location(FsFile *file, uint32_t block, uint64_t *offset, uint32_t *length, bool *plain)
+{
+    // Both this and the next index entry are needed to get the block length
+    if (block < m_cache->index_start || block + 1 >= m_cache->index_start + m_cache->index_count)
+    {
+        uint32_t count = std::min<uint32_t>(CSO_INDEX_CACHE_ENTRIES, m_num_blocks + 1 - block);
+        uint32_t bytes = count * 4;
+        if (!file->seek(CSO_HEADER_SIZE + (uint64_t)block * 4) ||
+            file->read(m_cache->index, bytes) != (int)bytes)
+        {
+            m_cache->index_count = 0;
+            return false;
+        }
+
+        // Index is little-endian like the platform, entries can be used directly
+        m_cache->index_start = block;
+        m_cache->index_count = count;
+        m_stats.file_bytes += bytes;
+    }
+
+    uint32_t entry = m_cache->index[block - m_cache->index_start];
+    uint32_t next = m_cache->index[block + 1 - m_cache->index_start];
+    uint64_t start = (uint64_t)(entry & ~CSO_INDEX_PLAIN) << m_index_shift;
+    uint64_t end = (uint64_t)(next & ~CSO_INDEX_PLAIN) << m_index_shift;
+    if (end <= start) return false;
+
+    *offset = start;
+    *length = std::min<uint64_t>(end - start, m_block_size);
+    *plain = (entry & CSO_INDEX_PLAIN);
+    return true;
+}
+
+const uint8_t *CSOReader::get_block(FsFile *file, uint32_t block)
+{
+    if (block >= m_num_blocks) return nullptr;
+
+    // Check cache and find least recently used slot
+    int slot = 0;
+    for (int i = 0; i < CSO_CACHE_BLOCKS; i++)
+    {
+        if (m_cache->valid[i] && m_cache->block[i] == block)
+        {
+            m_cache->last_used[i] = ++m_cache->counter;
+            m_stats.hits++;
+            return m_cache->data[i];
+        }
+
+        if (!m_cache->valid[i] ||
+            (m_cache->valid[slot] && m_cache->last_used[i] < m_cache->last_used[slot]))
+        {
+            slot = i;
+        }
+    }
+    m_stats.misses++;
+
+    uint64_t offset;
+    uint32_t length;
+    bool plain;
+    if (!get_block_location(file, block, &offset, &length, &plain))
+    {
+        logmsg("-- CSO image index invalid at block ", (int)block);
+        return nullptr;
+    }
+
+    // Last block can be shorter than others
+    uint32_t block_bytes = std::min<uint64_t>(m_block_size, m_total_bytes - (uint64_t)block * m_block_size);
+    uint8_t *dest = m_cache->data[slot];
+    m_cache->valid[slot] = false;
+
+    if (plain)
+    {
+        if (!file->seek(offset) || file->read(dest, block_bytes) != (int)block_bytes)
+        {
+            return nullptr;
+        }
+        m_stats.file_bytes += block_bytes;
+    }
+    else
+    {
+        if (!file->seek(offset) || file->read(m_cache->compressed, length) != (int)length)
+        {
+            return nullptr;
+        }
+        m_stats.file_bytes += length;
+
+        uint32_t start = micros();
+        struct uzlib_uncomp d;
+        uzlib_uncompress_init(&d, NULL, 0);
+        d.source = m_cache->compressed;
+        d.source_limit = m_cache->compressed + length;
+        d.source_read_cb = NULL;
+        d.dest_start = d.dest = dest;
+        d.dest_limit = dest + block_bytes;
+        int res = uzlib_uncompress(&d);
+        m_stats.decode_us += (uint32_t)(micros() - start);
+
+        if ((res != TINF_OK && res != TINF_DONE) || d.dest != d.dest_limit)
+        {
+            logmsg("-- CSO block ", (int)block, " decompression failed: ", res);
+            return nullptr;
+        }
+    }
+
+    m_cache->block[slot] = block;
+    m_cache->last_used[slot] = ++m_cache->counter;
+    m_cache->valid[slot] = true;
+    return dest;
+}
+
+void CSOReader::log_stats()
+{
+    uint32_t total = m_stats.hits + m_stats.misses;
+    if (total == 0) return;
+
+    logmsg("CSO image: ", (int)m_stats.hits, " block cache hits, ", (int)m_stats.misses, " misses, ",
+           (int)(m_stats.file_bytes / 1024), " kB read from file, ",
+           (int)(m_stats.decode_us / 1000), " ms decompressing");
+}
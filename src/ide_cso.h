@@ -0,0 +1,103 @@
+/**
+ * ZuluIDE™ - Copyright (c) 2023 Rabbit Hole Computing™
+ *
+ * ZuluIDE™ firmware is licensed under the GPL version 3 or any later version.
+ *
+ * https://www.gnu.org/licenses/gpl-3.0.html
+ * ----
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Under Section 7 of GPL version 3, you are granted additional
+ * permissions described in the ZuluIDE Hardware Support Library Exception
+ * (GPL-3.0_HSL_Exception.md), as published by Rabbit Hole Computing™.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+// Reader for CSO (CISO) compressed images.
+// The image is split into fixed size blocks that are compressed separately
+// with raw deflate. An index of block offsets in the file follows the header,
+// so any block can be located and decompressed on its own.
+// Blocks that did not compress are stored as is, marked by the top bit of
+// their index entry.
+
+#pragma once
+
+#include <stdint.h>
+#include <SdFat.h>
+
+// Largest supported block size, CD images normally use 2048
+#ifndef CSO_MAX_BLOCK_SIZE
+#define CSO_MAX_BLOCK_SIZE 2048
+#endif
+
+// Number of decompressed blocks kept in RAM
+#ifndef CSO_CACHE_BLOCKS
+#define CSO_CACHE_BLOCKS 4
+#endif
+
+// Number of block index entries read from the file at a time
+#ifndef CSO_INDEX_CACHE_ENTRIES
+#define CSO_INDEX_CACHE_ENTRIES 128
+#endif
+
+struct cso_cache_t;
+
+// The decompressed block cache and index window are kept in a work area
+// given by the caller, so that no RAM is used while no CSO image is open.
+class CSOReader
+{
+public:
+    CSOReader();
+
+    // Bytes needed for the work area, which must be 4-byte aligned
+    static size_t work_size();
+
+    // Check the file header and start using the file if it is a CSO image.
+    // The work area is used until close().
+    // Returns false if the file is not a supported CSO image.
+    bool open(FsFile *file, uint8_t *work);
+    void close();
+    bool is_open() { return m_open; }
+
+    // Size of the uncompressed image
+    uint64_t size() { return m_total_bytes; }
+
+    // Read uncompressed data from any position in the image
+    bool read(FsFile *file, uint64_t pos, uint8_t *dest, size_t len);
+
+    // Number of bytes read from the file since open()
+    uint64_t compressed_bytes_read() { return m_stats.file_bytes; }
+
+    void log_stats();
+
+protected:
+    bool m_open;
+    cso_cache_t *m_cache;
+    uint64_t m_total_bytes;
+    uint32_t m_block_size;
+    uint32_t m_num_blocks;
+    uint8_t m_index_shift;
+
+    struct {
+        uint32_t hits;
+        uint32_t misses;
+        uint64_t file_bytes;
+        uint64_t decode_us;
+    } m_stats;
+
+    // Find location of block in file
+    bool get_block_location(FsFile *file, uint32_t block, uint64_t *offset, uint32_t *length, bool *plain);
+
+    // Get pointer to decompressed block data, reading it from file if not cached
+    const uint8_t *get_block(FsFile *file, uint32_t block);
+};
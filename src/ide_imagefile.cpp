@@ -29,25 +29,72 @@
 #include "ZuluIDE_config.h"
 #include <assert.h>
 #include <algorithm>
+#include <minIni.h>
+#ifdef ENABLE_AUDIO_OUTPUT
+#include "ZuluIDE_audio.h"
+#endif
 
 // SD card callbacks from platform code use global state
 IDEImageFile::sd_cb_state_t IDEImageFile::sd_cb_state;
 
+// Audio playback reads its samples from the same SD card.
+// While a transfer is in progress, it gets the card only
+// between the SD card accesses done by the transfer loops.
+class TransferScope
+{
+public:
+    TransferScope()
+    {
+#ifdef ENABLE_AUDIO_OUTPUT
+        audio_transfer_begin();
+#endif
+    }
+
+    ~TransferScope()
+    {
+#ifdef ENABLE_AUDIO_OUTPUT
+        audio_transfer_end();
+#endif
+    }
+};
+
+// Called from transfer loops when SD card is not being accessed
+static void transfer_poll()
+{
+    platform_poll();
+#ifdef ENABLE_AUDIO_OUTPUT
+    audio_poll_transfer();
+#endif
+}
+
 IDEImageFile::IDEImageFile(): IDEImageFile(nullptr, 0)
 {
 
 }
 
 IDEImageFile::IDEImageFile(uint8_t *buffer, size_t buffer_size):
-    m_buffer(buffer), m_buffer_size(buffer_size), m_drive_type(DRIVE_TYPE_VIA_PREFIX)
+    m_cso_work_size(0), m_buffer(buffer), m_buffer_size(buffer_size), m_drive_type(DRIVE_TYPE_VIA_PREFIX), m_reserved_size(0)
 {
+    memset(&m_cache, 0, sizeof(m_cache));
+    memset(&m_readahead, 0, sizeof(m_readahead));
+    memset(&m_write_stats, 0, sizeof(m_write_stats));
     clear();
     memset(m_prefix, 0, sizeof(m_prefix));
 }
 
 void IDEImageFile::clear()
 {
+    close_cache();
+    readahead_invalidate();
+    pool_close_all();
+    log_readahead_stats();
+    log_write_stats();
+    m_readahead.hits = 0;
+    m_readahead.misses = 0;
+    close_cso();
+    m_vhd.close();
     m_blockdev = nullptr;
+    m_extent_count = 0;
     m_contiguous = false;
     m_first_sector = 0;
     m_capacity = 0;
@@ -67,9 +114,15 @@ bool IDEImageFile::open_file(FsVolume *volume, const char *filename, bool read_o
         read_only = true;
     }
 
+    close_cache();
+    close_cso();
+    m_vhd.close();
+    m_blockdev = nullptr;
+    m_extent_count = 0;
     m_contiguous = false;
     m_capacity = 0;
     m_read_only = read_only;
+    pool_close_all();
     m_file.close();
     m_folder.close();
 
@@ -96,17 +149,31 @@ bool IDEImageFile::open_file(FsVolume *volume, const char *filename, bool read_o
 // If m_is_folder is false, this is used only for opening the initial image.
 bool IDEImageFile::internal_open(const char *filename)
 {
+    close_cache();
+    readahead_invalidate();
+    m_vhd.close();
+    m_blockdev = nullptr;
+    m_extent_count = 0;
+    m_contiguous = false;
     m_file.open(&m_folder, filename, m_read_only ? O_RDONLY : O_RDWR);
 
     if (!m_file.isOpen())
     {
         m_capacity = 0;
-        if (m_file.isUnsupportedContainerType())
+        if (m_file.isUnsupportedContainerType() &&
+            m_vhd.open(&m_folder, filename, m_read_only))
+        {
+            // Dynamic VHD, blocks are allocated as they are written
+            m_capacity = m_vhd.size();
+            dbgmsg("Image file ", filename, " size ", (int)m_capacity);
+            return true;
+        }
+        else if (m_file.isUnsupportedContainerType())
         {
             logmsg("");
             logmsg("============ ERROR: Unsupported container image type ============");
             logmsg("Image is a ", m_file.getContainerNameCstr(), " container but the image type is unsupported.");
-            logmsg("Please use a container with a fixed size or fully allocated image");
+            logmsg("Please use a fixed size or dynamic container image");
             logmsg("=================================================================");
             logmsg("");
         }
@@ -125,15 +192,52 @@ bool IDEImageFile::internal_open(const char *filename)
     m_capacity = m_file.size();
     dbgmsg("Image file ", filename, " size ", (int)m_capacity);
 
+    // Compressed images are read through the filesystem and cannot be written.
+    // The block cache is taken from the start of the transfer buffer, so that
+    // space reserved from the end of it is not affected.
+    size_t cso_work_size = (CSOReader::work_size() + 511) & ~511;
+    if (!m_is_folder &&
+        m_file.getContainerFormat() == ZuluContainerFs::Container::None &&
+        cso_work_size <= m_buffer_size / 2 &&
+        m_cso.open(&m_file, m_buffer))
+    {
+        readahead_invalidate();
+        m_buffer += cso_work_size;
+        m_buffer_size -= cso_work_size;
+        m_cso_work_size = cso_work_size;
+        m_capacity = m_cso.size();
+        m_read_only = true;
+        return true;
+    }
+
     uint32_t begin = 0, end = 0;
     if (m_file.contiguousRange(&begin, &end))
     {
         dbgmsg("Image file ", filename, " is contiguous, sectors ", (int)begin, " to ", (int)end);
         m_first_sector = begin;
         m_contiguous = true;
+
+        // Container formats have headers before the image data,
+        // so only plain images can be accessed by SD card sector number.
+        if (m_file.getContainerFormat() == ZuluContainerFs::Container::None &&
+            ini_getbool("IDE", "direct_sd_access", true, CONFIGFILE))
+        {
+            m_blockdev = SD.card();
+        }
+    }
+    else if (m_file.getContainerFormat() == ZuluContainerFs::Container::None &&
+             ini_getbool("IDE", "direct_sd_access", true, CONFIGFILE) &&
+             build_extent_map())
+    {
+        if (!m_is_folder || g_log_debug)
+        {
+            logmsg("Image file ", filename, " is fragmented into ", (int)m_extent_count, " extents, using extent map");
+        }
+        m_blockdev = SD.card();
     }
     else
     {
+        m_extent_count = 0;
         if (!m_is_folder || g_log_debug)
         {
             logmsg("Image file ", filename, " is not contiguous, access will be slower");
@@ -143,21 +247,184 @@ bool IDEImageFile::internal_open(const char *filename)
     return true;
 }
 
+bool IDEImageFile::build_extent_map()
+{
+    FsVolume *vol = SD.vol();
+    uint8_t fat_type = vol->fatType();
+    uint32_t entry_size;
+    uint32_t entry_mask;
+    uint32_t end_of_chain;
+
+    if (fat_type == 16)
+    {
+        entry_size = 2;
+        entry_mask = 0xFFFF;
+        end_of_chain = 0xFFF8;
+    }
+    else if (fat_type == 32)
+    {
+        entry_size = 4;
+        entry_mask = 0x0FFFFFFF;
+        end_of_chain = 0x0FFFFFF8;
+    }
+    else if (fat_type == 64)
+    {
+        // exFAT uses the FAT for fragmented files
+        entry_size = 4;
+        entry_mask = 0xFFFFFFFF;
+        end_of_chain = 0xFFFFFFF8;
+    }
+    else
+    {
+        return false;
+    }
+
+    uint32_t sectors_per_cluster = vol->sectorsPerCluster();
+    uint32_t data_start = vol->dataStartSector();
+    uint32_t fat_start = vol->fatStartSector();
+    uint32_t first_sector = m_file.firstSector();
+    uint32_t total_sectors = (m_capacity + 511) / 512;
+    if (m_buffer_size < 512 || sectors_per_cluster == 0 || first_sector < data_start)
+    {
+        return false;
+    }
+
+    // Transfer buffer is free while opening, use it for FAT sectors
+    uint8_t *fat_buf = m_buffer;
+    uint32_t fat_buf_sector = UINT32_MAX;
+    uint32_t cluster = (first_sector - data_start) / sectors_per_cluster + 2;
+    uint32_t file_sector = 0;
+    m_extent_count = 0;
+
+    while (file_sector < total_sectors)
+    {
+        uint32_t sd_sector = data_start + (cluster - 2) * sectors_per_cluster;
+        if (m_extent_count > 0 &&
+            m_extents[m_extent_count - 1].sd_sector + m_extents[m_extent_count - 1].sectors == sd_sector)
+        {
+            m_extents[m_extent_count - 1].sectors += sectors_per_cluster;
+        }
+        else if (m_extent_count < IMAGE_EXTENT_MAP_SIZE)
+        {
+            m_extents[m_extent_count].file_sector = file_sector;
+            m_extents[m_extent_count].sd_sector = sd_sector;
+            m_extents[m_extent_count].sectors = sectors_per_cluster;
+            m_extent_count++;
+        }
+        else
+        {
+            dbgmsg("Image has more than ", (int)IMAGE_EXTENT_MAP_SIZE, " extents");
+            m_extent_count = 0;
+            return false;
+        }
+
+        file_sector += sectors_per_cluster;
+        if (file_sector >= total_sectors) break;
+
+        // Get next cluster from FAT
+        uint32_t offset = cluster * entry_size;
+        uint32_t fat_sector = fat_start + offset / 512;
+        if (fat_sector != fat_buf_sector)
+        {
+            platform_set_sd_callback(nullptr, nullptr);
+            if (!SD.card()->readSector(fat_sector, fat_buf))
+            {
+                m_extent_count = 0;
+                return false;
+            }
+            fat_buf_sector = fat_sector;
+        }
+
+        const uint8_t *entry = fat_buf + offset % 512;
+        uint32_t next = entry[0] | ((uint32_t)entry[1] << 8);
+        if (entry_size == 4)
+        {
+            next |= ((uint32_t)entry[2] << 16) | ((uint32_t)entry[3] << 24);
+        }
+        next &= entry_mask;
+
+        if (next < 2 || next >= end_of_chain)
+        {
+            dbgmsg("Cluster chain ended before end of image file at sector ", (int)file_sector);
+            m_extent_count = 0;
+            return false;
+        }
+        cluster = next;
+    }
+
+    return m_extent_count > 0;
+}
+
+bool IDEImageFile::map_sector(uint32_t file_sector, uint32_t *sd_sector, uint32_t *count)
+{
+    if (m_extent_count == 0)
+    {
+        // Contiguous file
+        *sd_sector = m_first_sector + file_sector;
+        *count = UINT32_MAX;
+        return true;
+    }
+
+    // Find last extent starting at or before file_sector
+    uint32_t lo = 0;
+    uint32_t hi = m_extent_count;
+    while (hi - lo > 1)
+    {
+        uint32_t mid = (lo + hi) / 2;
+        if (m_extents[mid].file_sector <= file_sector)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    const extent_t *extent = &m_extents[lo];
+    uint32_t offset = file_sector - extent->file_sector;
+    if (file_sector < extent->file_sector || offset >= extent->sectors)
+    {
+        return false;
+    }
+
+    *sd_sector = extent->sd_sector + offset;
+    *count = extent->sectors - offset;
+    return true;
+}
+
+// Return the CSO block cache to the transfer buffer
+void IDEImageFile::close_cso()
+{
+    m_cso.close();
+    if (m_cso_work_size > 0)
+    {
+        readahead_invalidate();
+        m_buffer -= m_cso_work_size;
+        m_buffer_size += m_cso_work_size;
+        m_cso_work_size = 0;
+    }
+}
+
 void IDEImageFile::close()
 {
+    close_cache();
+    readahead_invalidate();
+    pool_close_all();
+    close_cso();
+    m_vhd.close();
+    m_blockdev = nullptr;
+    m_extent_count = 0;
     m_file.close();
 }
 
 bool IDEImageFile::get_filename(char *buf, size_t buflen)
 {
-    if (!m_file.isOpen())
+    FsFile *file = m_vhd.is_open() ? m_vhd.file() : &m_file;
+    if (!file->isOpen())
     {
         buf[0] = '\0';
         return false;
     }
     else
     {
-        size_t name_len = m_file.getName(buf, buflen);
+        size_t name_len = file->getName(buf, buflen);
         // Assume a string length that fills the buffer exactly to have been truncated
         if (name_len == buflen - 1)
         {
@@ -210,7 +477,125 @@ bool IDEImageFile::select_image(const char *filename)
         return false;
     }
 
-    return internal_open(filename);
+    close_cache();
+    readahead_invalidate();
+    m_vhd.close();
+
+    pooled_file_t *entry = pool_find(filename);
+    if (!entry)
+    {
+        // Keep the current file open in the least recently used slot
+        entry = &m_file_pool[0];
+        for (int i = 0; i < IMAGE_FILE_POOL_SIZE; i++)
+        {
+            if (!m_file_pool[i].file.isOpen())
+            {
+                entry = &m_file_pool[i];
+                break;
+            }
+            else if (m_file_pool[i].last_used < entry->last_used)
+            {
+                entry = &m_file_pool[i];
+            }
+        }
+
+        entry->file.close();
+        pool_swap(entry);
+        return internal_open(filename);
+    }
+
+    pool_swap(entry);
+    return true;
+}
+
+/******************************/
+/* Open file pool             */
+/******************************/
+
+IDEImageFile::pooled_file_t *IDEImageFile::pool_find(const char *filename)
+{
+    static char name[MAX_FILE_PATH + 1];
+    for (int i = 0; i < IMAGE_FILE_POOL_SIZE; i++)
+    {
+        pooled_file_t *entry = &m_file_pool[i];
+        if (entry->file.isOpen() &&
+            entry->file.getName(name, sizeof(name)) < sizeof(name) - 1 &&
+            strcasecmp(name, filename) == 0)
+        {
+            return entry;
+        }
+    }
+
+    return nullptr;
+}
+
+void IDEImageFile::pool_swap(pooled_file_t *entry)
+{
+    // Extent map of the selected file is moved aside before the
+    // map of the current file is stored in its place.
+    extent_t *pool_extents = m_file_pool_extents[entry - m_file_pool];
+    extent_t extents[IMAGE_FILE_POOL_EXTENTS];
+    uint32_t extent_count = entry->extent_count;
+    memcpy(extents, pool_extents, extent_count * sizeof(extent_t));
+
+    pooled_file_t prev;
+    prev.file = m_file;
+    prev.capacity = m_capacity;
+    prev.contiguous = m_contiguous;
+    prev.direct = (m_blockdev != nullptr);
+    prev.extent_count = 0;
+    prev.first_sector = m_first_sector;
+    prev.last_used = ++m_file_pool_counter;
+
+    if (m_extent_count > IMAGE_FILE_POOL_EXTENTS)
+    {
+        // Too fragmented to keep the map, use filesystem access instead of walking the FAT again
+        prev.direct = false;
+    }
+    else if (m_extent_count > 0)
+    {
+        memcpy(pool_extents, m_extents, m_extent_count * sizeof(extent_t));
+        prev.extent_count = m_extent_count;
+    }
+
+    m_file = entry->file;
+    m_blockdev = nullptr;
+    m_extent_count = 0;
+    if (m_file.isOpen())
+    {
+        m_capacity = entry->capacity;
+        m_contiguous = entry->contiguous;
+        m_first_sector = entry->first_sector;
+        if (entry->direct)
+        {
+            memcpy(m_extents, extents, extent_count * sizeof(extent_t));
+            m_extent_count = extent_count;
+            m_blockdev = SD.card();
+        }
+    }
+
+    // Container files are not pooled because their state cannot be shared
+    if (prev.file.isOpen() && prev.file.getContainerFormat() == ZuluContainerFs::Container::None)
+    {
+        *entry = prev;
+    }
+    else
+    {
+        prev.file.close();
+        entry->file = ZuluContainerFs::ZCFsFile();
+        entry->extent_count = 0;
+    }
+}
+
+void IDEImageFile::pool_close_all()
+{
+    for (int i = 0; i < IMAGE_FILE_POOL_SIZE; i++)
+    {
+        m_file_pool[i].file.close();
+        m_file_pool[i].extent_count = 0;
+        m_file_pool[i].last_used = 0;
+    }
+    m_file_pool_counter = 0;
 }
 
 void IDEImageFile::set_drive_type(drive_type_t type)
@@ -248,7 +633,7 @@ uint64_t IDEImageFile::file_position()
 
 bool IDEImageFile::is_open()
 {
-    return m_file.isOpen();
+    return m_file.isOpen() || m_vhd.is_open();
 }
 
 bool IDEImageFile::writable()
@@ -260,24 +645,100 @@ bool IDEImageFile::writable()
 /* Data transfer from SD card */
 /******************************/
 
+bool IDEImageFile::use_blockdev(uint64_t startpos, size_t blocksize, size_t num_blocks)
+{
+    // Sector commands can only transfer whole sectors within the image
+    return m_blockdev != nullptr
+        && (startpos % 512) == 0
+        && (blocksize % 512) == 0
+        && startpos + (uint64_t)blocksize * num_blocks <= m_capacity;
+}
+
+bool IDEImageFile::blockdev_transfer(uint64_t startpos, uint8_t *buf, size_t len, bool write)
+{
+    uint32_t sector = startpos / 512;
+    uint32_t remain = len / 512;
+
+    while (remain > 0)
+    {
+        uint32_t sd_sector, count;
+        if (!map_sector(sector, &sd_sector, &count)) return false;
+        count = std::min(count, remain);
+
+        bool status;
+        if (write)
+            status = m_blockdev->writeSectors(sd_sector, buf, count);
+        else
+            status = m_blockdev->readSectors(sd_sector, buf, count);
+
+        if (!status) return false;
+
+        sector += count;
+        buf += count * 512;
+        remain -= count;
+    }
+
+    return true;
+}
+
 bool IDEImageFile::read(uint64_t startpos, size_t blocksize, size_t num_blocks, Callback *callback)
 {
-    if (!m_file.seek(startpos)) return false;
+    TransferScope transfer;
+
+    if (m_cache.dirty)
+    {
+        // Make sure read does not return stale data
+        int64_t first = startpos / 512;
+        int64_t last = (startpos + (uint64_t)blocksize * num_blocks - 1) / 512;
+        if (last >= m_cache.window_start && first < m_cache.window_start + m_cache.sectors)
+        {
+            if (!cache_writeback()) return false;
+        }
+    }
 
     assert(blocksize <= m_buffer_size);
 
+    if (m_cso.is_open())
+    {
+        return read_compressed(startpos, blocksize, num_blocks, callback);
+    }
+
+    if (m_vhd.is_open())
+    {
+        return read_vhd(startpos, blocksize, num_blocks, callback);
+    }
+
+    // Use data from read-ahead, it is at the start of the buffer
+    size_t prefetched = 0;
+    if (m_readahead.target > 0)
+    {
+        if (startpos == m_readahead.start && m_readahead.bytes >= blocksize)
+        {
+            prefetched = std::min<size_t>(m_readahead.bytes / blocksize, num_blocks);
+            m_readahead.hits++;
+        }
+        else
+        {
+            m_readahead.misses++;
+        }
+    }
+    readahead_predict(startpos, blocksize, num_blocks);
+
+    bool direct = use_blockdev(startpos, blocksize, num_blocks);
+    if (!direct && prefetched < num_blocks && !m_file.seek(startpos + (uint64_t)prefetched * blocksize)) return false;
+
     sd_cb_state.callback = callback;
     sd_cb_state.error = false;
     sd_cb_state.buffer = m_buffer;
     sd_cb_state.num_blocks = num_blocks;
     sd_cb_state.blocksize = blocksize;
     sd_cb_state.blocks_done = 0;
-    sd_cb_state.blocks_available = 0;
+    sd_cb_state.blocks_available = prefetched;
     sd_cb_state.bufsize_blocks = m_buffer_size / blocksize;
 
     while (sd_cb_state.blocks_done < num_blocks && !sd_cb_state.error)
     {
-        platform_poll();
+        transfer_poll();
 
         // Check if we have buffer space to read more from SD card
         if (sd_cb_state.blocks_available < num_blocks &&
@@ -297,12 +758,21 @@ bool IDEImageFile::read(uint64_t startpos, size_t blocksize, size_t num_blocks,
 
             // Read from SD card and process callbacks
             uint8_t *buf = m_buffer + blocksize * start_idx;
+            bool status;
             platform_set_sd_callback(&IDEImageFile::sd_read_callback, buf);
-            int status = m_file.read(buf, blocksize * max_read);
+            if (direct)
+            {
+                uint64_t pos = startpos + (uint64_t)sd_cb_state.blocks_available * blocksize;
+                status = blockdev_transfer(pos, buf, blocksize * max_read, false);
+            }
+            else
+            {
+                status = (m_file.read(buf, blocksize * max_read) == blocksize * max_read);
+            }
             platform_set_sd_callback(nullptr, nullptr);
 
             // Check status of SD card read
-            if (status != blocksize * max_read)
+            if (!status)
                 sd_cb_state.error = true;
             else
                 sd_cb_state.blocks_available += max_read;
@@ -319,6 +789,113 @@ bool IDEImageFile::read(uint64_t startpos, size_t blocksize, size_t num_blocks,
     return !sd_cb_state.error;
 }
 
+// Blocks are decompressed one at a time to the transfer buffer and
+// passed to the callback as soon as they are ready.
+bool IDEImageFile::read_compressed(uint64_t startpos, size_t blocksize, size_t num_blocks, Callback *callback)
+{
+    size_t bufsize_blocks = m_buffer_size / blocksize;
+    size_t blocks_available = 0;
+    size_t blocks_done = 0;
+
+    while (blocks_done < num_blocks)
+    {
+        transfer_poll();
+
+        if (blocks_available < num_blocks && blocks_available < blocks_done + bufsize_blocks)
+        {
+            uint8_t *dest = m_buffer + (blocks_available % bufsize_blocks) * blocksize;
+            if (!m_cso.read(&m_file, startpos + (uint64_t)blocks_available * blocksize, dest, blocksize))
+            {
+                return false;
+            }
+            blocks_available++;
+        }
+
+        size_t start_idx = blocks_done % bufsize_blocks;
+        size_t count = std::min(blocks_available - blocks_done, bufsize_blocks - start_idx);
+        if (count > 0)
+        {
+            ssize_t status = callback->read_callback(m_buffer + start_idx * blocksize, blocksize, count);
+            if (status < 0) return false;
+            blocks_done += status;
+        }
+    }
+
+    return true;
+}
+
+// Dynamic VHD reads fill the whole transfer buffer at a time,
+// unallocated parts are filled with zeros without accessing the SD card.
+bool IDEImageFile::read_vhd(uint64_t startpos, size_t blocksize, size_t num_blocks, Callback *callback)
+{
+    size_t bufsize_blocks = m_buffer_size / blocksize;
+    size_t blocks_available = 0;
+    size_t blocks_done = 0;
+
+    while (blocks_done < num_blocks)
+    {
+        transfer_poll();
+
+        if (blocks_available == blocks_done && blocks_available < num_blocks)
+        {
+            size_t count = std::min(num_blocks - blocks_available, bufsize_blocks);
+            if (!m_vhd.read(startpos + (uint64_t)blocks_available * blocksize, m_buffer, count * blocksize))
+            {
+                logmsg("IDEImageFile::read_vhd() failed at position ", startpos + (uint64_t)blocks_available * blocksize);
+                return false;
+            }
+            blocks_available += count;
+        }
+
+        size_t start_idx = blocks_done % bufsize_blocks;
+        ssize_t status = callback->read_callback(m_buffer + start_idx * blocksize, blocksize, blocks_available - blocks_done);
+        if (status < 0) return false;
+        blocks_done += status;
+    }
+
+    return true;
+}
+
+// Blocks that are not yet stored in the file are allocated before receiving
+// data from the host, because allocation uses the transfer buffer to extend the file.
+bool IDEImageFile::write_vhd(uint64_t startpos, size_t blocksize, size_t num_blocks, Callback *callback)
+{
+    if (!m_vhd.allocate(startpos, (uint64_t)blocksize * num_blocks, m_buffer, m_buffer_size))
+    {
+        logmsg("IDEImageFile::write_vhd() block allocation failed at position ", startpos);
+        return false;
+    }
+
+    size_t bufsize_blocks = m_buffer_size / blocksize;
+    size_t blocks_done = 0;
+    while (blocks_done < num_blocks)
+    {
+        // Receive up to a full buffer of data from host
+        size_t count = std::min(num_blocks - blocks_done, bufsize_blocks);
+        size_t received = 0;
+        while (received < count)
+        {
+            transfer_poll();
+            bool first_xfer = (blocks_done + received == 0);
+            bool last_xfer = (blocks_done + count == num_blocks);
+            ssize_t status = callback->write_callback(m_buffer + received * blocksize, blocksize,
+                                                      count - received, first_xfer, last_xfer);
+            if (status < 0) return false;
+            received += status;
+        }
+
+        uint64_t pos = startpos + (uint64_t)blocks_done * blocksize;
+        if (!m_vhd.write(pos, m_buffer, count * blocksize))
+        {
+            logmsg("IDEImageFile::write_vhd() SD card write failed at position ", pos);
+            return false;
+        }
+        blocks_done += count;
+    }
+
+    return true;
+}
+
 void IDEImageFile::sd_read_callback(uint32_t bytes_complete)
 {
     // Update number of blocks available by the latest callback status.
@@ -347,13 +924,43 @@ void IDEImageFile::sd_read_callback(uint32_t bytes_complete)
 /* Data transfer to SD card */
 /******************************/
 
-// For now this uses simple blocking access, because we don't need CD-ROM write yet.
+// The buffer is used as two halves: while one half is being written to SD card,
+// the callback receives data from the host to the other half from sd_write_callback().
 bool IDEImageFile::write(uint64_t startpos, size_t blocksize, size_t num_blocks, Callback *callback)
 {
-    if (!m_file.seek(startpos)) return false;
+    TransferScope transfer;
+    bool cache_status;
+    readahead_invalidate();
+    m_cache.unsynced = true;
+    if (m_cso.is_open())
+    {
+        return false;
+    }
+
+    if (m_vhd.is_open())
+    {
+        return write_vhd(startpos, blocksize, num_blocks, callback) && write_through_sync();
+    }
+
+    if (m_cache.enabled && cache_write(startpos, blocksize, num_blocks, callback, &cache_status))
+    {
+        return cache_status;
+    }
+
+    bool direct = use_blockdev(startpos, blocksize, num_blocks);
+    if (!direct && !m_file.seek(startpos)) return false;
 
     assert(blocksize <= m_buffer_size);
 
+    if (startpos != m_write_stats.next_pos)
+    {
+        log_write_stats();
+    }
+    if (m_write_stats.bytes == 0)
+    {
+        m_write_stats.start = millis();
+    }
+
     sd_cb_state.callback = callback;
     sd_cb_state.error = false;
     sd_cb_state.buffer = m_buffer;
@@ -362,33 +969,60 @@ bool IDEImageFile::write(uint64_t startpos, size_t blocksize, size_t num_blocks,
     sd_cb_state.blocks_done = 0;
     sd_cb_state.blocks_available = 0;
     sd_cb_state.bufsize_blocks = m_buffer_size / blocksize;
+    sd_cb_state.pipeline_blocks = std::max<size_t>(sd_cb_state.bufsize_blocks / 2, 1);
 
     while (sd_cb_state.blocks_done < num_blocks && !sd_cb_state.error)
     {
-        platform_poll();
+        transfer_poll();
 
-        // Check if callback can provide more data
-        sd_write_callback(0);
+        if (sd_cb_state.blocks_available == sd_cb_state.blocks_done)
+        {
+            // Nothing to write, SD card is idle while receiving data
+            sd_write_callback(0);
+
+            if (sd_cb_state.blocks_available == sd_cb_state.blocks_done && !sd_cb_state.error)
+            {
+                // Callback needs more space than half of the buffer
+                // for the next block, e.g. for a long WRITE MULTIPLE block
+                sd_cb_state.pipeline_blocks = sd_cb_state.bufsize_blocks;
+            }
+        }
 
         // Check if there is data to be written to SD card
-        if (sd_cb_state.blocks_done < sd_cb_state.num_blocks)
+        if (sd_cb_state.blocks_done < sd_cb_state.blocks_available && !sd_cb_state.error)
         {
             // Check how many contiguous blocks are available to process.
+            // Limit to half of the buffer so that the other half is free
+            // for receiving data during the write.
             size_t start_idx = sd_cb_state.blocks_done % sd_cb_state.bufsize_blocks;
             size_t max_write = std::min({
                 sd_cb_state.blocks_available - sd_cb_state.blocks_done,
-                sd_cb_state.bufsize_blocks - start_idx
+                sd_cb_state.bufsize_blocks - start_idx,
+                sd_cb_state.pipeline_blocks
             });
 
             // Write data to SD card and process callbacks
             uint8_t *buf = m_buffer + blocksize * start_idx;
+            bool status;
             platform_set_sd_callback(&IDEImageFile::sd_write_callback, buf);
-            int status = m_file.write(buf, blocksize * max_write);
+            if (direct)
+            {
+                uint64_t pos = startpos + (uint64_t)sd_cb_state.blocks_done * blocksize;
+                status = blockdev_transfer(pos, buf, blocksize * max_write, true);
+            }
+            else
+            {
+                status = (m_file.write(buf, blocksize * max_write) == blocksize * max_write);
+            }
             platform_set_sd_callback(nullptr, nullptr);
 
             // Check status of SD card write
-            if (status != blocksize * max_write)
+            if (!status)
+            {
+                logmsg("IDEImageFile::write() SD card write failed at position ",
+                    startpos + (uint64_t)sd_cb_state.blocks_done * blocksize);
                 sd_cb_state.error = true;
+            }
             else
             {
                 sd_cb_state.blocks_done += max_write;
@@ -396,7 +1030,58 @@ bool IDEImageFile::write(uint64_t startpos, size_t blocksize, size_t num_blocks,
         }
     }
 
-    return !sd_cb_state.error;
+    if (sd_cb_state.error || !write_through_sync())
+    {
+        m_write_stats.bytes = 0;
+        m_write_stats.next_pos = UINT64_MAX;
+        return false;
+    }
+
+    m_write_stats.bytes += (uint64_t)blocksize * num_blocks;
+    m_write_stats.next_pos = startpos + (uint64_t)blocksize * num_blocks;
+    m_write_stats.last = millis();
+    return true;
+}
+
+// SD card writes return while the card is still programming the last blocks,
+// so that receiving data for the next chunk of the same command overlaps it.
+// Without write cache the host expects the data to be stored when the command
+// completes, so the wait is done before returning. VHD sector bitmap updates
+// are partial sector writes that stay in the filesystem cache until flushed.
+bool IDEImageFile::write_through_sync()
+{
+    if (m_cache.enabled || !SD.card())
+    {
+        return true;
+    }
+
+    if (m_vhd.is_open() && !m_vhd.file()->flush())
+    {
+        logmsg("IDEImageFile::write() VHD sector bitmap flush failed");
+        return false;
+    }
+
+    if (!SD.card()->syncDevice())
+    {
+        logmsg("IDEImageFile::write() SD card did not finish programming");
+        return false;
+    }
+
+    return true;
+}
+
+void IDEImageFile::log_write_stats()
+{
+    if (m_write_stats.bytes >= WRITE_SPEED_LOG_MIN_BYTES)
+    {
+        uint32_t elapsed = m_write_stats.last - m_write_stats.start;
+        if (elapsed == 0) elapsed = 1;
+        uint32_t mbps_x10 = m_write_stats.bytes * 10000 / elapsed / 1048576;
+        logmsg("Sustained write of ", (int)(m_write_stats.bytes / 1048576), " MB in ", (int)elapsed, " ms, ",
+               (int)(mbps_x10 / 10), ".", (int)(mbps_x10 % 10), " MB/s");
+    }
+
+    m_write_stats.bytes = 0;
 }
 
 void IDEImageFile::sd_write_callback(uint32_t bytes_complete)
@@ -405,6 +1090,12 @@ void IDEImageFile::sd_write_callback(uint32_t bytes_complete)
     // sd_cb_state.blocks_done will be updated when SD card write() returns.
     size_t blocks_done = sd_cb_state.blocks_done + bytes_complete / sd_cb_state.blocksize;
 
+    if (sd_cb_state.error)
+    {
+        // Stop receiving after host side failure, SD card write still completes
+        return;
+    }
+
     if (sd_cb_state.blocks_available < sd_cb_state.num_blocks &&
         sd_cb_state.blocks_available < blocks_done + sd_cb_state.bufsize_blocks)
     {
@@ -413,18 +1104,20 @@ void IDEImageFile::sd_write_callback(uint32_t bytes_complete)
         // 1. Total requested transfer size
         // 2. Number of free slots in buffer
         // 3. Space until wrap point of the buffer
+        // 4. Pipeline granularity, so that SD card writes can start early
         size_t start_idx = sd_cb_state.blocks_available % sd_cb_state.bufsize_blocks;
         size_t max_read = std::min({
             sd_cb_state.num_blocks - sd_cb_state.blocks_available,
-            sd_cb_state.blocks_done + sd_cb_state.bufsize_blocks - sd_cb_state.blocks_available,
-            sd_cb_state.bufsize_blocks - start_idx
+            blocks_done + sd_cb_state.bufsize_blocks - sd_cb_state.blocks_available,
+            sd_cb_state.bufsize_blocks - start_idx,
+            sd_cb_state.pipeline_blocks
         });
 
         if (max_read > 0)
         {
             // Receive data from callback
-            bool last_xfer = sd_cb_state.num_blocks == sd_cb_state.blocks_done + max_read;
-            bool first_xfer = sd_cb_state.blocks_done == 0;
+            bool last_xfer = sd_cb_state.num_blocks == sd_cb_state.blocks_available + max_read;
+            bool first_xfer = sd_cb_state.blocks_available == 0;
             uint8_t *data_start = sd_cb_state.buffer + start_idx * sd_cb_state.blocksize;
             ssize_t status = sd_cb_state.callback->write_callback(data_start, sd_cb_state.blocksize, max_read, first_xfer, last_xfer);
             if (status < 0)
@@ -434,3 +1127,417 @@ void IDEImageFile::sd_write_callback(uint32_t bytes_complete)
         }
     }
 }
+
+/******************************/
+/* Write-back cache           */
+/******************************/
+
+void IDEImageFile::set_write_cache(bool enable)
+{
+    if (enable == m_cache.enabled) return;
+
+    if (!cache_writeback())
+    {
+        // Keep the cache so that the data is not lost, flush_cache() reports the error
+        logmsg("Write cache could not be written, keeping it enabled");
+        m_cache.error = true;
+        return;
+    }
+    readahead_invalidate();
+
+    if (enable)
+    {
+        // Split transfer buffer in half
+        size_t cache_size = std::min<size_t>(m_buffer_size / 2, 64 * 512);
+        if (cache_size < 512)
+        {
+            logmsg("Transfer buffer too small for write cache");
+            return;
+        }
+
+        m_buffer_size -= cache_size;
+        m_cache.buffer = m_buffer + m_buffer_size;
+        m_cache.sectors = cache_size / 512;
+        m_cache.enabled = true;
+        dbgmsg("Write cache enabled, ", (int)m_cache.sectors, " sectors");
+    }
+    else
+    {
+        m_buffer_size += m_cache.sectors * 512;
+        m_cache.buffer = nullptr;
+        m_cache.sectors = 0;
+        m_cache.enabled = false;
+        dbgmsg("Write cache disabled");
+    }
+}
+
+uint8_t *IDEImageFile::reserve_buffer(size_t bytes)
+{
+    if (m_cache.enabled)
+    {
+        // Write cache is already at the end of the buffer
+        return nullptr;
+    }
+
+    readahead_invalidate();
+    m_buffer_size += m_reserved_size;
+    m_reserved_size = 0;
+
+    bytes = (bytes + 3) & ~3;
+    if (bytes == 0 || bytes > m_buffer_size / 2)
+    {
+        return nullptr;
+    }
+
+    m_buffer_size -= bytes;
+    m_reserved_size = bytes;
+    dbgmsg("Reserved ", (int)bytes, " bytes of transfer buffer, ", (int)m_buffer_size, " left for transfers");
+    return m_buffer + m_buffer_size;
+}
+
+bool IDEImageFile::cache_write(uint64_t startpos, size_t blocksize, size_t num_blocks, Callback *callback, bool *status)
+{
+    uint64_t len = (uint64_t)blocksize * num_blocks;
+    if ((startpos % 512) != 0 || (len % 512) != 0 || len == 0)
+    {
+        if (!cache_writeback())
+        {
+            *status = false;
+            return true;
+        }
+        return false;
+    }
+
+    int64_t first = startpos / 512;
+    int64_t count = len / 512;
+    int64_t align = m_contiguous ? (m_first_sector % m_cache.sectors) : 0;
+    int64_t window_start = ((first + align) / m_cache.sectors) * m_cache.sectors - align;
+
+    if (first + count > window_start + m_cache.sectors)
+    {
+        // Request does not fit in one window, write directly
+        if (!cache_writeback())
+        {
+            *status = false;
+            return true;
+        }
+        return false;
+    }
+
+    if (window_start != m_cache.window_start)
+    {
+        if (!cache_writeback())
+        {
+            *status = false;
+            return true;
+        }
+        m_cache.window_start = window_start;
+    }
+
+    // Receive data from host directly into the cache window
+    size_t idx = first - window_start;
+    size_t blocks_done = 0;
+    *status = true;
+    while (blocks_done < num_blocks)
+    {
+        transfer_poll();
+        uint8_t *buf = m_cache.buffer + idx * 512 + blocks_done * blocksize;
+        ssize_t got = callback->write_callback(buf, blocksize, num_blocks - blocks_done,
+                                               blocks_done == 0, true);
+        if (got < 0)
+        {
+            *status = false;
+            break;
+        }
+        blocks_done += got;
+    }
+
+    // Mark the received sectors for writing
+    size_t sectors_done = (blocks_done * blocksize) / 512;
+    for (size_t i = 0; i < sectors_done; i++)
+    {
+        m_cache.dirty |= (uint64_t)1 << (idx + i);
+    }
+    m_cache.last_write = millis();
+
+    return true;
+}
+
+bool IDEImageFile::flush_cache()
+{
+    bool status = cache_writeback();
+
+    // Report failures of earlier background flushes once
+    if (m_cache.error)
+    {
+        status = false;
+        m_cache.error = false;
+    }
+
+    if (status && m_cache.unsynced)
+    {
+        // Commit file metadata and wait for SD card to finish programming
+        if (m_file.isOpen() && !m_file.flush()) status = false;
+        if (m_vhd.is_open() && !m_vhd.file()->flush()) status = false;
+        if (SD.card() && !SD.card()->syncDevice()) status = false;
+
+        if (status)
+            m_cache.unsynced = false;
+        else
+            logmsg("Image file sync to SD card failed");
+    }
+
+    return status;
+}
+
+void IDEImageFile::close_cache()
+{
+    if (!flush_cache() && m_cache.dirty)
+    {
+        logmsg("Write cache flush failed before closing image, ", (int)__builtin_popcountll(m_cache.dirty), " sectors lost");
+    }
+    m_cache.dirty = 0;
+    m_cache.error = false;
+}
+
+bool IDEImageFile::cache_writeback()
+{
+    if (!m_cache.dirty) return true;
+
+    uint64_t dirty = m_cache.dirty;
+
+    if (!m_file.isOpen())
+    {
+        logmsg("Write cache flush failed, image file is not open");
+        return false;
+    }
+
+    uint32_t first = __builtin_ctzll(dirty);
+    uint32_t last = 63 - __builtin_clzll(dirty);
+    uint8_t *buf = m_cache.buffer;
+    int64_t base = m_cache.window_start;
+
+    // Fill any clean gaps so that the dirty range goes out as one multi-sector write.
+    // Reading is cheaper than the extra program cycles of separate small writes.
+    uint32_t i = first;
+    while (i <= last)
+    {
+        if (dirty & ((uint64_t)1 << i))
+        {
+            i++;
+            continue;
+        }
+
+        uint32_t gap_end = i;
+        while (!(dirty & ((uint64_t)1 << gap_end))) gap_end++;
+
+        uint32_t gap_len = (gap_end - i) * 512;
+        if (!m_file.seek((base + i) * 512) ||
+            m_file.read(buf + i * 512, gap_len) != (int)gap_len)
+        {
+            logmsg("Write cache flush failed to read sectors ", (int)(base + i), " to ", (int)(base + gap_end - 1));
+            return false;
+        }
+        i = gap_end;
+    }
+
+    uint32_t write_len = (last - first + 1) * 512;
+    if (!m_file.seek((base + first) * 512) ||
+        m_file.write(buf + first * 512, write_len) != write_len)
+    {
+        logmsg("Write cache flush failed to write sectors ", (int)(base + first), " to ", (int)(base + last));
+        return false;
+    }
+
+    // Sectors are clean only after the write has succeeded
+    m_cache.dirty &= ~dirty;
+    dbgmsg("Write cache flushed sectors ", (int)(base + first), " to ", (int)(base + last));
+    return true;
+}
+
+void IDEImageFile::poll()
+{
+    if (m_cache.dirty && (uint32_t)(millis() - m_cache.last_write) > WRITE_CACHE_FLUSH_DELAY_MS)
+    {
+        if (!cache_writeback())
+        {
+            // Data stays in cache, retry after the delay and fail next FLUSH CACHE
+            m_cache.error = true;
+            m_cache.last_write = millis();
+        }
+    }
+
+    if (m_write_stats.bytes > 0 && (uint32_t)(millis() - m_write_stats.last) > WRITE_SPEED_LOG_IDLE_MS)
+    {
+        log_write_stats();
+    }
+
+    if (m_readahead.bytes < m_readahead.target && !m_cache.dirty && m_file.isOpen())
+    {
+        // Read one chunk at a time to keep command response latency low
+        uint32_t len = std::min<uint32_t>(READAHEAD_CHUNK_SIZE, m_readahead.target - m_readahead.bytes);
+        platform_set_sd_callback(nullptr, nullptr);
+        if (!m_file.seek(m_readahead.start + m_readahead.bytes) ||
+            m_file.read(m_buffer + m_readahead.bytes, len) != (int)len)
+        {
+            dbgmsg("Read-ahead failed at ", m_readahead.start + m_readahead.bytes);
+            m_readahead.target = m_readahead.bytes;
+        }
+        else
+        {
+            m_readahead.bytes += len;
+        }
+    }
+}
+
+/******************************/
+/* Benchmark                  */
+/******************************/
+
+// Consumes read data without doing anything with it
+class BenchmarkCallback: public IDEImage::Callback
+{
+public:
+    virtual ssize_t read_callback(const uint8_t *data, size_t blocksize, size_t num_blocks) override
+    {
+        return num_blocks;
+    }
+
+    virtual ssize_t write_callback(uint8_t *data, size_t blocksize, size_t num_blocks, bool first_xfer, bool last_xfer) override
+    {
+        return -1;
+    }
+};
+
+void IDEImageFile::benchmark(uint32_t max_bytes)
+{
+    const size_t blocksize = 512;
+    const size_t blocks_per_read = 128;
+    BenchmarkCallback callback;
+    SdCard *blockdev = m_blockdev;
+
+    uint32_t total = std::min<uint64_t>(max_bytes, m_capacity);
+    total -= total % (blocksize * blocks_per_read);
+    if (total == 0 || !is_open()) return;
+
+    for (int pass = 0; pass < 2; pass++)
+    {
+        if (pass == 1 && !blockdev) break;
+        m_blockdev = (pass == 0) ? nullptr : blockdev;
+
+        uint32_t start = millis();
+        bool status = true;
+        for (uint32_t pos = 0; pos < total && status; pos += blocksize * blocks_per_read)
+        {
+            readahead_invalidate();
+            status = read(pos, blocksize, blocks_per_read, &callback);
+        }
+        uint32_t elapsed = millis() - start;
+        if (elapsed == 0) elapsed = 1;
+
+        const char *method = (pass == 1) ? "direct sector" : (m_cso.is_open() ? "compressed image" :
+                                                         m_vhd.is_open() ? "dynamic VHD" : "filesystem");
+        logmsg("-- Benchmark ", method, " read of ", (int)(total / 1024), " kB: ",
+               status ? "" : "FAILED, ", (int)(total / elapsed), " kB/s");
+    }
+
+    m_blockdev = blockdev;
+    readahead_invalidate();
+
+    if (m_cso.is_open())
+    {
+        // Compare decompression to reading the same amount of raw data from the file
+        uint64_t file_bytes = m_cso.compressed_bytes_read();
+        uint32_t raw_total = std::min<uint64_t>(total, m_file.size());
+        raw_total -= raw_total % m_buffer_size;
+        uint32_t start = millis();
+        bool status = m_file.seek(0);
+        for (uint32_t pos = 0; pos < raw_total && status; pos += m_buffer_size)
+        {
+            status = (m_file.read(m_buffer, m_buffer_size) == (int)m_buffer_size);
+        }
+        uint32_t elapsed = millis() - start;
+        if (elapsed == 0) elapsed = 1;
+
+        logmsg("-- Benchmark raw file read of ", (int)(raw_total / 1024), " kB: ",
+               status ? "" : "FAILED, ", (int)(raw_total / elapsed), " kB/s, compressed image read ",
+               (int)(file_bytes / 1024), " kB from file so far");
+    }
+    else if (m_vhd.is_open())
+    {
+        // Compare to sequential read of the same file, which is how a fixed size image is read
+        FsFile *file = m_vhd.file();
+        uint32_t raw_total = std::min<uint64_t>(total, file->size());
+        raw_total -= raw_total % m_buffer_size;
+        uint32_t start = millis();
+        bool status = file->seek(0);
+        for (uint32_t pos = 0; pos < raw_total && status; pos += m_buffer_size)
+        {
+            status = (file->read(m_buffer, m_buffer_size) == (int)m_buffer_size);
+        }
+        uint32_t elapsed = millis() - start;
+        if (elapsed == 0) elapsed = 1;
+
+        logmsg("-- Benchmark fixed size equivalent read of ", (int)(raw_total / 1024), " kB: ",
+               status ? "" : "FAILED, ", (int)(raw_total / elapsed), " kB/s");
+        m_vhd.log_stats();
+    }
+}
+
+/******************************/
+/* Read-ahead                 */
+/******************************/
+
+void IDEImageFile::readahead_predict(uint64_t startpos, size_t blocksize, size_t num_blocks)
+{
+    uint64_t len = (uint64_t)blocksize * num_blocks;
+    int64_t stride = startpos - m_readahead.prev_start;
+    uint64_t next = 0;
+    uint64_t next_len = 0;
+
+    if (startpos == m_readahead.prev_end)
+    {
+        // Sequential access, prefetch as much as half of the buffer
+        next = startpos + len;
+        next_len = m_buffer_size / 2;
+    }
+    else if (stride > 0 && stride == m_readahead.prev_stride)
+    {
+        // Constant stride, prefetch the same amount from next position
+        next = startpos + stride;
+        next_len = std::min<uint64_t>(len, m_buffer_size / 2);
+    }
+
+    m_readahead.prev_start = startpos;
+    m_readahead.prev_end = startpos + len;
+    m_readahead.prev_stride = stride;
+    m_readahead.bytes = 0;
+    m_readahead.target = 0;
+
+    // Whole blocks only and not past the end of the image
+    if (next_len > 0 && next < m_capacity)
+    {
+        next_len = std::min<uint64_t>(next_len, m_capacity - next);
+        next_len -= next_len % blocksize;
+        m_readahead.start = next;
+        m_readahead.target = next_len;
+    }
+}
+
+void IDEImageFile::readahead_invalidate()
+{
+    m_readahead.prev_start = 0;
+    m_readahead.prev_end = UINT64_MAX;
+    m_readahead.prev_stride = 0;
+    m_readahead.bytes = 0;
+    m_readahead.target = 0;
+}
+
+void IDEImageFile::log_readahead_stats()
+{
+    uint32_t total = m_readahead.hits + m_readahead.misses;
+    if (total == 0) return;
+
+    logmsg("Read-ahead: ", (int)m_readahead.hits, " hits, ", (int)m_readahead.misses, " misses, hit rate ",
+           (int)((uint64_t)m_readahead.hits * 100 / total), "%");
+}
@@ -28,6 +28,24 @@
 #include <SdFat.h>
 #include <ZCFsFile.h>
 #include <zuluide/ide_drive_type.h>
+#include "ide_cso.h"
+#include "ide_vhd.h"
+
+// Maximum number of fragments in an image file for extent map based access
+#ifndef IMAGE_EXTENT_MAP_SIZE
+#define IMAGE_EXTENT_MAP_SIZE 128
+#endif
+
+// Number of previously used track files kept open for folder images
+#ifndef IMAGE_FILE_POOL_SIZE
+#define IMAGE_FILE_POOL_SIZE 4
+#endif
+
+// Number of extents kept for each fragmented file in the pool. More fragmented
+// files use filesystem access when they are selected again from the pool.
+#ifndef IMAGE_FILE_POOL_EXTENTS
+#define IMAGE_FILE_POOL_EXTENTS 32
+#endif
 
 // Interface for emulated image files
 class IDEImage
@@ -92,6 +110,19 @@ public:
     // It will return the number of blocks available at data.
     virtual bool write(uint64_t startpos, size_t blocksize, size_t num_blocks, Callback *callback) = 0;
 
+    // Enable or disable write-back caching of small writes.
+    // When enabled, data written may stay in RAM until flush_cache() is called.
+    virtual void set_write_cache(bool enable) = 0;
+
+    // Write any cached data to the image file and make it durable on the SD card.
+    // Returns false if any cached write has failed since the previous call.
+    virtual bool flush_cache() = 0;
+
+    // Reserve bytes at the end of the transfer buffer for the device to keep data in.
+    // A new reservation replaces the previous one, 0 bytes releases it.
+    // Returns nullptr if the space is not available.
+    virtual uint8_t *reserve_buffer(size_t bytes) = 0;
+
     // \todo This should really be moved to IDEDevice somehow
     virtual void set_drive_type(drive_type_t type) = 0;
     virtual drive_type_t get_drive_type() = 0;
@@ -125,6 +156,27 @@ public:
     virtual bool read(uint64_t startpos, size_t blocksize, size_t num_blocks, Callback *callback);
     virtual bool write(uint64_t startpos, size_t blocksize, size_t num_blocks, Callback *callback);
 
+    // Write-back cache uses the upper half of the transfer buffer when enabled.
+    virtual void set_write_cache(bool enable);
+    virtual bool flush_cache();
+
+    // At most half of the transfer buffer can be reserved, not while write cache is enabled.
+    virtual uint8_t *reserve_buffer(size_t bytes);
+
+    // Called from main loop while waiting for commands.
+    // Flushes write cache after it has been idle and fills read-ahead buffer.
+    void poll();
+
+    // Measure read speed of the current image through the filesystem and,
+    // when available, through direct SD card sector access.
+    // Compressed images are compared against raw reads of the file.
+    void benchmark(uint32_t max_bytes);
+
+    // Read-ahead statistics
+    uint32_t readahead_hits() { return m_readahead.hits; }
+    uint32_t readahead_misses() { return m_readahead.misses; }
+    void log_readahead_stats();
+
     // Support for opening a folder for images that consist of multiple files.
     // Currently used for .cue / .bin sets.
     virtual bool is_folder();
@@ -151,6 +203,9 @@ public:
 
 protected:
     ZuluContainerFs::ZCFsFile m_file;
+
+    // Set for contiguous images without container, which are then accessed
+    // directly with SD card sector commands starting at m_first_sector.
     SdCard *m_blockdev;
 
     bool m_is_folder;
@@ -161,6 +216,14 @@ protected:
 
     uint64_t m_capacity;
     bool m_read_only;
+
+    // Decompresses CSO images, m_capacity is then the uncompressed size
+    CSOReader m_cso;
+    size_t m_cso_work_size; // Bytes at the start of the transfer buffer used by m_cso
+    void close_cso();
+
+    // Dynamic VHD images are opened here when the container library does not support them
+    VHDImage m_vhd;
     uint8_t *m_buffer;
     size_t m_buffer_size;
 
@@ -169,6 +232,123 @@ protected:
 
     bool internal_open(const char *filename);
 
+    // Read from compressed image, decompressing blocks to the transfer buffer
+    bool read_compressed(uint64_t startpos, size_t blocksize, size_t num_blocks, Callback *callback);
+
+    // Transfer to and from dynamic VHD image through the transfer buffer
+    bool read_vhd(uint64_t startpos, size_t blocksize, size_t num_blocks, Callback *callback);
+    bool write_vhd(uint64_t startpos, size_t blocksize, size_t num_blocks, Callback *callback);
+
+    // Wait for SD card to finish programming a write when write cache is disabled
+    bool write_through_sync();
+
+    // Check if transfer can bypass the filesystem and use m_blockdev
+    bool use_blockdev(uint64_t startpos, size_t blocksize, size_t num_blocks);
+
+    // Transfer sectors with m_blockdev, splitting the access at extent boundaries.
+    // The buffer is used consecutively so that SD callbacks stay in sync.
+    bool blockdev_transfer(uint64_t startpos, uint8_t *buf, size_t len, bool write);
+
+    // Extent map of a fragmented image file.
+    // Each extent is a run of consecutive SD card sectors, sorted by position
+    // in the image. Empty when the file is contiguous or the map could not be built.
+    struct extent_t {
+        uint32_t file_sector; // First 512-byte sector of the extent within the file
+        uint32_t sd_sector; // Corresponding SD card sector
+        uint32_t sectors; // Length of the extent
+    };
+    extent_t m_extents[IMAGE_EXTENT_MAP_SIZE];
+    uint32_t m_extent_count;
+
+    // Follow the cluster chain of m_file in the FAT and fill m_extents.
+    // Done only when a file is opened, files in the pool keep their map.
+    // Returns false if the file system is unsupported or there are too many extents.
+    bool build_extent_map();
+
+    // Find SD card sector for an image sector.
+    // Returns number of consecutive sectors available from that point in *count.
+    bool map_sector(uint32_t file_sector, uint32_t *sd_sector, uint32_t *count);
+
+    // Files of a folder image that have been open recently.
+    // select_image() swaps the current file with a pooled one instead of
+    // opening it again, keeping the information found when it was opened.
+    struct pooled_file_t {
+        ZuluContainerFs::ZCFsFile file;
+        uint64_t capacity;
+        bool contiguous;
+        bool direct; // Direct SD sector access was in use
+        uint32_t extent_count; // Extents stored in m_file_pool_extents, 0 if contiguous
+        uint32_t first_sector;
+        uint32_t last_used;
+    };
+    pooled_file_t m_file_pool[IMAGE_FILE_POOL_SIZE];
+    extent_t m_file_pool_extents[IMAGE_FILE_POOL_SIZE][IMAGE_FILE_POOL_EXTENTS];
+    uint32_t m_file_pool_counter;
+
+    // Find open file by name from pool
+    pooled_file_t *pool_find(const char *filename);
+
+    // Exchange current file and its state with a pooled file
+    void pool_swap(pooled_file_t *entry);
+
+    void pool_close_all();
+
+    // Write-back cache state.
+    // The cache holds one window of sectors, aligned to SD card sectors when
+    // the image is contiguous, so that flushes map to aligned multi-sector writes.
+    struct {
+        bool enabled;
+        uint8_t *buffer;
+        uint32_t sectors; // Window size in sectors, at most 64
+        int64_t window_start; // First image sector of the window, can be negative due to alignment
+        uint64_t dirty; // Bitmask of sectors in window that need to be written
+        uint32_t last_write; // millis() of latest cached write
+        bool error; // Background write-back failed, reported by next flush_cache()
+        bool unsynced; // Data written since file and SD card were last synced
+    } m_cache;
+
+    // Bytes at the end of the transfer buffer reserved by reserve_buffer()
+    size_t m_reserved_size;
+
+    // Write dirty sectors to the file, they stay dirty if the write fails
+    bool cache_writeback();
+
+    // Flush before the image is closed or changed, cache contents are discarded even on failure
+    void close_cache();
+
+    // Returns false if the request cannot be cached and should be written directly
+    bool cache_write(uint64_t startpos, size_t blocksize, size_t num_blocks, Callback *callback, bool *status);
+
+    // Read-ahead state.
+    // When consecutive reads are sequential or have a constant stride, the
+    // predicted next extent is read to the start of the transfer buffer
+    // between commands. read() then starts from the data already in RAM.
+    struct {
+        uint64_t prev_start; // Start of previous read request
+        uint64_t prev_end; // End of previous read request
+        int64_t prev_stride; // Distance between previous two read starts
+        uint64_t start; // Image position of prefetched data
+        uint32_t bytes; // Number of bytes prefetched to m_buffer
+        uint32_t target; // Number of bytes to prefetch
+        uint32_t hits;
+        uint32_t misses;
+    } m_readahead;
+
+    // Throughput of consecutive sequential writes
+    struct {
+        uint64_t next_pos; // Position following the last write
+        uint64_t bytes; // Bytes written in the current sequence
+        uint32_t start; // millis() at start of sequence
+        uint32_t last; // millis() at end of last write
+    } m_write_stats;
+
+    // Log write speed if enough data has been written sequentially, and reset statistics
+    void log_write_stats();
+
+    // Update access pattern detection with a new read request
+    void readahead_predict(uint64_t startpos, size_t blocksize, size_t num_blocks);
+    void readahead_invalidate();
+
     struct sd_cb_state_t {
         IDEImage::Callback *callback;
         bool error;
@@ -178,6 +358,7 @@ protected:
         size_t bufsize_blocks;
         size_t blocks_done;
         size_t blocks_available;
+        size_t pipeline_blocks; // Maximum blocks per transfer when writing
     };
     static sd_cb_state_t sd_cb_state;
     static void sd_read_callback(uint32_t bytes_complete);
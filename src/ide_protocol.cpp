@@ -30,6 +30,7 @@
 #include "ide_protocol.h"
 #include "ide_phy.h"
 #include "ide_constants.h"
+#include "ide_stats.h"
 #include <minIni.h>
 
 // Map from command index for command name for logging
@@ -208,7 +209,9 @@ void ide_protocol_poll()
 
             regs.error = 0;
             ide_phy_set_signals(g_ide_signals | IDE_SIGNAL_DASP); // Set motherboard IDE status led
+            ide_stats_command_start(cmd);
             bool status = device->handle_command(&regs);
+            ide_stats_command_end();
             ide_phy_set_signals(g_ide_signals);
 
             if (!status)
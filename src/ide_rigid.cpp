@@ -25,6 +25,7 @@
 
 #include "ide_rigid.h"
 #include "ide_utils.h"
+#include "ide_stats.h"
 #include "atapi_constants.h"
 #include "ZuluIDE.h"
 #include "ZuluIDE_config.h"
@@ -69,6 +70,14 @@ void IDERigidDevice::initialize(int devidx)
     memset(&m_ata_state, 0, sizeof(m_ata_state));
     memset(&m_removable, 0, sizeof(m_removable));
     m_devinfo.bytes_per_sector = 512;
+    m_ata_state.drq_sectors = 1;
+
+    m_devinfo.write_cache_supported = ini_getbool("IDE", "write_cache", false, CONFIGFILE);
+    m_ata_state.write_cache = m_devinfo.write_cache_supported;
+    if (m_devinfo.write_cache_supported)
+    {
+        logmsg("-- Write-back cache enabled for hard drive images");
+    }
 }
 
 void IDERigidDevice::post_image_setup()
@@ -156,11 +165,13 @@ void IDERigidDevice::reset()
 void IDERigidDevice::set_image(IDEImage *image)
 {
     m_image = image;
+    if (m_image) m_image->set_write_cache(m_ata_state.write_cache);
 }
 
 void IDERigidDevice::insert_media(IDEImage *image)
 {
     m_image = image;
+    if (m_image) m_image->set_write_cache(m_ata_state.write_cache);
 }
 
 
@@ -185,6 +196,11 @@ bool IDERigidDevice::handle_command(ide_registers_t *regs)
         case IDE_CMD_READ_SECTORS: return cmd_read(regs, false, false);
         case IDE_CMD_READ_VERIFY_SECTORS: return cmd_read(regs, false, true);
         case IDE_CMD_WRITE_SECTORS: return cmd_write(regs, false);
+
+        // Multiple sectors per DRQ block in PIO mode
+        case IDE_CMD_SET_MULTIPLE_MODE: return cmd_set_multiple_mode(regs);
+        case IDE_CMD_READ_MULTIPLE: return cmd_read_multiple(regs);
+        case IDE_CMD_WRITE_MULTIPLE: return cmd_write_multiple(regs);
         case IDE_CMD_READ_BUFFER: return cmd_read_buffer(regs);
         case IDE_CMD_WRITE_BUFFER: return cmd_write_buffer(regs);
         case IDE_CMD_INIT_DEV_PARAMS: return cmd_init_dev_params(regs);
@@ -198,6 +214,8 @@ bool IDERigidDevice::handle_command(ide_registers_t *regs)
         case IDE_CMD_IDLE_IMMEDIATE_E1H: // fall through
         case IDE_CMD_IDLE_97H:           // fall through
         case IDE_CMD_IDLE_E3H: return cmd_idle(regs);
+        case IDE_CMD_FLUSH_CACHE: // fall through
+        case IDE_CMD_FLUSH_CACHE_EXT: return cmd_flush_cache(regs);
         default: return false;
     }
 }
@@ -267,6 +285,18 @@ bool IDERigidDevice::cmd_set_features(ide_registers_t *regs)
     {
         dbgmsg("-- Enable read look-ahead --");
     }
+    else if (feature == IDE_SET_FEATURE_ENABLE_WRITE_CACHE && m_devinfo.write_cache_supported)
+    {
+        dbgmsg("-- Enable write cache --");
+        m_ata_state.write_cache = true;
+        if (m_image) m_image->set_write_cache(true);
+    }
+    else if (feature == IDE_SET_FEATURE_DISABLE_WRITE_CACHE && m_devinfo.write_cache_supported)
+    {
+        dbgmsg("-- Disable write cache --");
+        m_ata_state.write_cache = false;
+        if (m_image) m_image->set_write_cache(false);
+    }
     else
     {
         dbgmsg("-- Unknown SET_FEATURE: ", feature);
@@ -361,6 +391,7 @@ bool IDERigidDevice::cmd_read(ide_registers_t *regs, bool dma_transfer, bool ver
     }
     else
     {
+        m_ata_state.sectors_left = sector_count;
         bool status = m_image->read((uint64_t)lba * m_devinfo.bytes_per_sector, m_devinfo.bytes_per_sector, sector_count, this);
         status = status && ata_send_wait_finish();
         m_ata_state.data_state = ATA_DATA_IDLE;
@@ -411,6 +442,7 @@ bool IDERigidDevice::cmd_write(ide_registers_t *regs, bool dma_transfer)
 
     if (m_image && m_image->writable())
     {
+        m_ata_state.sectors_left = sector_count;
         status = m_image->write((uint64_t)lba * m_devinfo.bytes_per_sector,
                             m_devinfo.bytes_per_sector, sector_count,
                             this);
@@ -429,6 +461,65 @@ bool IDERigidDevice::cmd_write(ide_registers_t *regs, bool dma_transfer)
     return status;
 }
 
+// Max number of sectors per DRQ block for READ/WRITE MULTIPLE
+uint16_t IDERigidDevice::max_multiple_count()
+{
+    uint32_t max_count = m_phy_caps.max_blocksize / m_devinfo.bytes_per_sector;
+    if (max_count > 128) max_count = 128;
+    return max_count;
+}
+
+bool IDERigidDevice::cmd_set_multiple_mode(ide_registers_t *regs)
+{
+    uint16_t count = regs->sector_count;
+
+    // Count must be a power of two not exceeding the PHY block size
+    if (count > max_multiple_count() || (count & (count - 1)) != 0)
+    {
+        dbgmsg("-- Unsupported multiple count ", (int)count, ", max ", (int)max_multiple_count());
+        return false;
+    }
+
+    if (count == 0)
+        dbgmsg("-- Disable multiple mode");
+    else
+        dbgmsg("-- Set multiple mode ", (int)count, " sectors per block");
+
+    m_ata_state.multiple_count = count;
+    regs->error = 0;
+    ide_phy_set_regs(regs);
+    ide_phy_assert_irq(IDE_STATUS_DEVRDY | IDE_STATUS_DSC);
+    return true;
+}
+
+bool IDERigidDevice::cmd_read_multiple(ide_registers_t *regs)
+{
+    if (m_ata_state.multiple_count == 0)
+    {
+        dbgmsg("-- READ MULTIPLE without SET MULTIPLE MODE");
+        return false;
+    }
+
+    m_ata_state.drq_sectors = m_ata_state.multiple_count;
+    bool status = cmd_read(regs, false, false);
+    m_ata_state.drq_sectors = 1;
+    return status;
+}
+
+bool IDERigidDevice::cmd_write_multiple(ide_registers_t *regs)
+{
+    if (m_ata_state.multiple_count == 0)
+    {
+        dbgmsg("-- WRITE MULTIPLE without SET MULTIPLE MODE");
+        return false;
+    }
+
+    m_ata_state.drq_sectors = m_ata_state.multiple_count;
+    bool status = cmd_write(regs, false);
+    m_ata_state.drq_sectors = 1;
+    return status;
+}
+
 bool IDERigidDevice::cmd_read_buffer(ide_registers_t *regs)
 {
     m_ata_state.data_state = ATA_DATA_IDLE;
@@ -470,6 +561,7 @@ bool IDERigidDevice::cmd_write_buffer(ide_registers_t *regs)
         }
     }
     ide_phy_read_block(ide_disk_buffer, 512, false);
+    ide_stats_add_bytes(512);
     ide_phy_stop_transfers();
     regs->status |= IDE_STATUS_BSY;
     ide_phy_set_regs(regs);
@@ -559,7 +651,7 @@ bool IDERigidDevice::cmd_identify_device(ide_registers_t *regs)
     copy_id_string(&idf[IDE_IDENTIFY_OFFSET_SERIAL_NUMBER], 10, m_devconfig.ata_serial);
     copy_id_string(&idf[IDE_IDENTIFY_OFFSET_FIRMWARE_REV], 4, m_devconfig.ata_revision);
     copy_id_string(&idf[IDE_IDENTIFY_OFFSET_MODEL_NUMBER], 20, m_devconfig.ata_model);
-    idf[IDE_IDENTIFY_OFFSET_MAX_SECTORS] = 0x8000;// 0x8020;
+    idf[IDE_IDENTIFY_OFFSET_MAX_SECTORS] = 0x8000 | max_multiple_count();
 
     idf[IDE_IDENTIFY_OFFSET_CAPABILITIES_1] = (m_phy_caps.supports_iordy ? 1 << 11 : 0) |
                                              (1 << 10) | // iordy may be disabled
@@ -578,8 +670,15 @@ bool IDERigidDevice::cmd_identify_device(ide_registers_t *regs)
     uint32_t current_sector_cap = m_devinfo.current_cylinders * m_devinfo.current_heads * m_devinfo.current_sectors;
     idf[IDE_IDENTIFY_OFFSET_CURRENT_CAPACITY_IN_SECTORS_LOW] = current_sector_cap & 0xFFFF;;
     idf[IDE_IDENTIFY_OFFSET_CURRENT_CAPACITY_IN_SECTORS_HI] = (current_sector_cap >> 16) & 0xFFFF;
-    idf[IDE_IDENTIFY_OFFSET_TOTAL_SECTORS]     = lba & 0xFFFF;
-    idf[IDE_IDENTIFY_OFFSET_TOTAL_SECTORS + 1] = (lba >> 16) & 0xFFFF;
+    // 28-bit addressable sectors, images larger than 128 GB require 48-bit addressing
+    uint32_t lba28 = (lba > 0x0FFFFFFF) ? 0x0FFFFFFF : lba;
+    if (m_ata_state.multiple_count > 0)
+    {
+        // Current multiple sector setting is valid
+        idf[IDE_IDENTIFY_OFFSET_MULTI_SECTOR_VALID] = 0x0100 | m_ata_state.multiple_count;
+    }
+    idf[IDE_IDENTIFY_OFFSET_TOTAL_SECTORS]     = lba28 & 0xFFFF;
+    idf[IDE_IDENTIFY_OFFSET_TOTAL_SECTORS + 1] = (lba28 >> 16) & 0xFFFF;
     idf[IDE_IDENTIFY_OFFSET_MODEINFO_SINGLEWORD] = 0;// 0x0007; // disabling single word dma
     idf[IDE_IDENTIFY_OFFSET_MODEINFO_MULTIWORD] = 0; // 0x0103; // disabling multi-word dma
 
@@ -594,6 +693,17 @@ bool IDERigidDevice::cmd_identify_device(ide_registers_t *regs)
     idf[IDE_IDENTIFY_OFFSET_COMMAND_SET_SUPPORT_3] = 0x4000;
     idf[IDE_IDENTIFY_OFFSET_COMMAND_SET_ENABLED_1] = 0x7004;
 
+    // FLUSH CACHE command supported
+    idf[IDE_IDENTIFY_OFFSET_COMMAND_SET_SUPPORT_2] |= (1 << 12);
+    idf[IDE_IDENTIFY_OFFSET_COMMAND_SET_ENABLED_2] |= (1 << 12);
+
+    if (m_devinfo.write_cache_supported)
+    {
+        idf[IDE_IDENTIFY_OFFSET_COMMAND_SET_SUPPORT_1] |= (1 << 5);
+        if (m_ata_state.write_cache)
+            idf[IDE_IDENTIFY_OFFSET_COMMAND_SET_ENABLED_1] |= (1 << 5);
+    }
+
     if (m_phy_caps.max_udma_mode >= 0)
     {
         // Bitmask of supported UDMA modes
@@ -635,6 +745,7 @@ bool IDERigidDevice::cmd_identify_device(ide_registers_t *regs)
 
     ide_phy_start_write(sizeof(idf));
     ide_phy_write_block((uint8_t*)idf, sizeof(idf));
+    ide_stats_add_bytes(sizeof(idf));
 
     uint32_t start = millis();
     while (!ide_phy_is_write_finished())
@@ -652,7 +763,6 @@ bool IDERigidDevice::cmd_identify_device(ide_registers_t *regs)
     return true;
 }
 
-
 bool IDERigidDevice::cmd_recalibrate(ide_registers_t *regs)
 {
 
@@ -665,8 +775,31 @@ bool IDERigidDevice::cmd_recalibrate(ide_registers_t *regs)
     return true;
 }
 
+bool IDERigidDevice::cmd_flush_cache(ide_registers_t *regs)
+{
+    if (m_image && !m_image->flush_cache())
+    {
+        regs->error = IDE_ERROR_ABORT;
+        ide_phy_set_regs(regs);
+        ide_phy_assert_irq(IDE_STATUS_DEVRDY | IDE_STATUS_DSC | IDE_STATUS_ERR);
+        return true;
+    }
+
+    ide_phy_assert_irq(IDE_STATUS_DEVRDY | IDE_STATUS_DSC);
+    return true;
+}
+
 bool IDERigidDevice::cmd_standby(ide_registers_t *regs)
 {
+    // Cached data must be on media before the host may remove power
+    if (m_image && !m_image->flush_cache())
+    {
+        regs->error = IDE_ERROR_ABORT;
+        ide_phy_set_regs(regs);
+        ide_phy_assert_irq(IDE_STATUS_DEVRDY | IDE_STATUS_DSC | IDE_STATUS_ERR);
+        return true;
+    }
+
     if (regs->command == IDE_CMD_STANDBY_96H || regs->command == IDE_CMD_STANDBY_E2H)
     {
         dbgmsg("Standby command is a stub, timeout value of ", regs->sector_count, " ignored. Signaling INTRQ and device ready");
@@ -700,6 +833,12 @@ void IDERigidDevice::handle_event(ide_event_t evt)
         if (evt == IDE_EVENT_HWRST)
         {
             m_ata_state.udma_mode = -1;
+            m_ata_state.multiple_count = 0;
+            if (m_ata_state.write_cache != m_devinfo.write_cache_supported)
+            {
+                m_ata_state.write_cache = m_devinfo.write_cache_supported;
+                if (m_image) m_image->set_write_cache(m_ata_state.write_cache);
+            }
         }
 
         set_device_signature(0, true);
@@ -798,6 +937,7 @@ ssize_t IDERigidDevice::ata_send_data(const uint8_t *data, size_t blocksize, siz
             data += blocksize;
             blocks_sent++;
         }
+        ide_stats_add_bytes(blocks_sent * blocksize);
 
         if (blocks_sent == 0)
         {
@@ -860,6 +1000,7 @@ bool IDERigidDevice::ata_send_data_block(const uint8_t *data, uint16_t blocksize
         int udma_mode = (m_ata_state.dma_requested ? m_ata_state.udma_mode : -1);
         ide_phy_start_write(blocksize, udma_mode);
         ide_phy_write_block(data, blocksize);
+        ide_stats_add_bytes(blocksize);
     }
     else
     {
@@ -881,6 +1022,7 @@ bool IDERigidDevice::ata_send_data_block(const uint8_t *data, uint16_t blocksize
         }
 
         ide_phy_write_block(data, blocksize);
+        ide_stats_add_bytes(blocksize);
     }
 
     return true;
@@ -915,7 +1057,16 @@ bool IDERigidDevice::ata_recv_data(uint8_t *data, size_t blocksize, size_t num_b
 
     int udma_mode = (m_ata_state.dma_requested ? m_ata_state.udma_mode : -1);
     size_t max_blocksize = m_phy_caps.max_blocksize;
-    if (blocksize > max_blocksize)
+    if (m_ata_state.drq_sectors > 1)
+    {
+        // WRITE MULTIPLE, host transfers drq_sectors per interrupt.
+        // Caller provides whole DRQ blocks, except for the last one.
+        size_t drq_blocks = std::min<size_t>(m_ata_state.drq_sectors, num_blocks);
+        assert(num_blocks % drq_blocks == 0);
+        blocksize *= drq_blocks;
+        num_blocks /= drq_blocks;
+    }
+    else if (blocksize > max_blocksize)
     {
         // Have to split the blocks for phy
         size_t split = (blocksize + max_blocksize - 1) / max_blocksize;
@@ -964,6 +1115,7 @@ bool IDERigidDevice::ata_recv_data(uint8_t *data, size_t blocksize, size_t num_b
         bool continue_transfer = (i + 1 < num_blocks);
         // dbgmsg("Reading datablock ", (int)i, " continue ", continue_transfer);
         ide_phy_ata_read_block(data + blocksize * i, blocksize, continue_transfer);
+        ide_stats_add_bytes(blocksize);
     }
 
     ide_phy_stop_transfers(&m_ata_state.crc_errors);
@@ -1009,6 +1161,7 @@ bool IDERigidDevice::ata_recv_data_block(uint8_t *data, uint16_t blocksize)
     }
 
     ide_phy_read_block(data, blocksize);
+    ide_stats_add_bytes(blocksize);
     ide_phy_stop_transfers();
     return true;
 }
@@ -1019,14 +1172,48 @@ bool IDERigidDevice::ata_recv_data_block(uint8_t *data, uint16_t blocksize)
 ssize_t IDERigidDevice::read_callback(const uint8_t *data, size_t blocksize, size_t num_blocks)
 {
     platform_poll();
-    return ata_send_data(data, blocksize, num_blocks);
+
+    if (m_ata_state.drq_sectors > 1)
+    {
+        // READ MULTIPLE, send drq_sectors per DRQ block.
+        // Last block of the command can be shorter.
+        size_t drq_blocks = std::min<size_t>(m_ata_state.drq_sectors, m_ata_state.sectors_left);
+        if (num_blocks < drq_blocks)
+        {
+            // Wait for rest of the DRQ block from SD card
+            return 0;
+        }
+
+        ssize_t status = ata_send_data(data, blocksize * drq_blocks, num_blocks / drq_blocks);
+        if (status <= 0) return status;
+
+        m_ata_state.sectors_left -= status * drq_blocks;
+        return status * drq_blocks;
+    }
+
+    ssize_t status = ata_send_data(data, blocksize, num_blocks);
+    if (status > 0) m_ata_state.sectors_left -= status;
+    return status;
 }
 
 // Called by IDEImage to request reception of more data from IDE bus
 ssize_t IDERigidDevice::write_callback(uint8_t *data, size_t blocksize, size_t num_blocks, bool first_xfer, bool last_xfer)
 {
+    if (m_ata_state.drq_sectors > 1)
+    {
+        // WRITE MULTIPLE, receive only whole DRQ blocks
+        size_t drq_blocks = std::min<size_t>(m_ata_state.drq_sectors, m_ata_state.sectors_left);
+        if (num_blocks < drq_blocks)
+        {
+            // Wait for buffer space for a complete DRQ block
+            return 0;
+        }
+        num_blocks -= num_blocks % drq_blocks;
+    }
+
     if (ata_recv_data(data, blocksize, num_blocks, first_xfer, last_xfer))
     {
+        m_ata_state.sectors_left -= num_blocks;
         return num_blocks;
     }
     else
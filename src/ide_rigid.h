@@ -101,6 +101,7 @@ protected:
         uint8_t current_sectors;
         uint8_t current_heads;
         uint16_t current_cylinders;
+        bool write_cache_supported; // Write-back cache allowed by zuluide.ini
     } m_devinfo;
 
     enum ata_data_state_t {
@@ -116,6 +117,10 @@ protected:
         int udma_mode;  // Negotiated udma mode, or negative if not enabled
         bool dma_requested; // Host requests to use DMA transfer for current command
         int crc_errors; // CRC errors in latest transfer
+        uint16_t multiple_count; // Sectors per DRQ block set by SET MULTIPLE MODE, 0 if disabled
+        uint16_t drq_sectors; // Sectors per DRQ block for current command
+        uint32_t sectors_left; // Sectors not yet transferred in current command
+        bool write_cache; // Write-back cache enabled by host
     } m_ata_state;
 
     struct
@@ -143,11 +148,16 @@ protected:
     virtual bool cmd_write_buffer(ide_registers_t *regs);
     virtual bool cmd_init_dev_params(ide_registers_t *regs);
     virtual bool cmd_identify_device(ide_registers_t *regs);
+    virtual bool cmd_set_multiple_mode(ide_registers_t *regs);
+    virtual bool cmd_read_multiple(ide_registers_t *regs);
+    virtual bool cmd_write_multiple(ide_registers_t *regs);
     virtual bool cmd_recalibrate(ide_registers_t *regs);
+    virtual bool cmd_flush_cache(ide_registers_t *regs);
     virtual bool cmd_standby(ide_registers_t *regs);
     virtual bool cmd_idle(ide_registers_t *regs);
 
     // Helper methods
+    uint16_t max_multiple_count();
     // convert lba to cylinder, head, sector values
     void lba2chs(const uint32_t lba, uint16_t &cylinder, uint8_t &head, uint8_t &sector);
     // Methods used by ATA command implementations
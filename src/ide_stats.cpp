@@ -0,0 +1,151 @@
+/**
+ * ZuluIDE™ - Copyright (c) 2023 Rabbit Hole Computing™
+ *
+ * ZuluIDE™ firmware is licensed under the GPL version 3 or any later version.
+ *
+ * https://www.gnu.org/licenses/gpl-3.0.html
+ * ----
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Under Section 7 of GPL version 3, you are granted additional
+ * permissions described in the ZuluIDE Hardware Support Library Exception
+ * (GPL-3.0_HSL_Exception.md), as published by Rabbit Hole Computing™.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#include "ide_stats.h"
+#include "ZuluIDE.h"
+#include "ZuluIDE_log.h"
+#include <stdio.h>
+#include <string.h>
+
+// ATAPI opcodes are stored after the ATA opcodes in the index
+#define IDE_STATS_ATAPI_KEY 0x100
+
+struct ide_stats_entry_t {
+    uint16_t key;
+    uint32_t count;
+    uint64_t bytes;
+    uint64_t total_us;
+    uint32_t min_us;
+    uint32_t max_us;
+    uint32_t histogram[IDE_STATS_HISTOGRAM_BUCKETS];
+};
+
+static struct {
+    // Maps key to entry index + 1, or 0 if no entry yet
+    uint8_t index[512];
+    ide_stats_entry_t entries[IDE_STATS_MAX_COMMANDS];
+    uint32_t num_entries;
+    uint32_t dropped;
+
+    // Currently executing command
+    bool active;
+    uint16_t key;
+    uint32_t start_us;
+    uint32_t bytes;
+} g_ide_stats;
+
+void ide_stats_command_start(uint8_t ata_cmd)
+{
+    g_ide_stats.active = true;
+    g_ide_stats.key = ata_cmd;
+    g_ide_stats.bytes = 0;
+    g_ide_stats.start_us = micros();
+}
+
+void ide_stats_set_atapi_command(uint8_t atapi_cmd)
+{
+    g_ide_stats.key = IDE_STATS_ATAPI_KEY | atapi_cmd;
+}
+
+void ide_stats_add_bytes(uint32_t bytes)
+{
+    g_ide_stats.bytes += bytes;
+}
+
+void ide_stats_command_end()
+{
+    if (!g_ide_stats.active) return;
+    g_ide_stats.active = false;
+
+    uint32_t elapsed = micros() - g_ide_stats.start_us;
+
+    uint8_t idx = g_ide_stats.index[g_ide_stats.key];
+    if (idx == 0)
+    {
+        if (g_ide_stats.num_entries >= IDE_STATS_MAX_COMMANDS)
+        {
+            g_ide_stats.dropped++;
+            return;
+        }
+
+        ide_stats_entry_t *entry = &g_ide_stats.entries[g_ide_stats.num_entries++];
+        entry->key = g_ide_stats.key;
+        entry->min_us = UINT32_MAX;
+        idx = g_ide_stats.num_entries;
+        g_ide_stats.index[g_ide_stats.key] = idx;
+    }
+
+    ide_stats_entry_t *entry = &g_ide_stats.entries[idx - 1];
+    entry->count++;
+    entry->bytes += g_ide_stats.bytes;
+    entry->total_us += elapsed;
+    if (elapsed < entry->min_us) entry->min_us = elapsed;
+    if (elapsed > entry->max_us) entry->max_us = elapsed;
+
+    // Bucket N holds latencies from 2^(N-1) to 2^N - 1 microseconds
+    int bucket = (elapsed == 0) ? 0 : (32 - __builtin_clz(elapsed));
+    if (bucket >= IDE_STATS_HISTOGRAM_BUCKETS) bucket = IDE_STATS_HISTOGRAM_BUCKETS - 1;
+    entry->histogram[bucket]++;
+}
+
+void ide_stats_log()
+{
+    logmsg("IDE command statistics (latency in us, histogram buckets are powers of two):");
+
+    for (uint32_t i = 0; i < g_ide_stats.num_entries; i++)
+    {
+        const ide_stats_entry_t *entry = &g_ide_stats.entries[i];
+        bool atapi = (entry->key & IDE_STATS_ATAPI_KEY);
+
+        logmsg("-- ", atapi ? "ATAPI " : "ATA ", (uint8_t)entry->key,
+               ": count ", (int)entry->count,
+               ", kB ", (int)(entry->bytes / 1024),
+               ", min ", (int)entry->min_us,
+               ", mean ", (int)(entry->total_us / entry->count),
+               ", max ", (int)entry->max_us);
+
+        // Print histogram up to the last non-empty bucket
+        char buf[IDE_STATS_HISTOGRAM_BUCKETS * 11 + 1];
+        int len = 0;
+        int last = IDE_STATS_HISTOGRAM_BUCKETS - 1;
+        while (last > 0 && entry->histogram[last] == 0) last--;
+        for (int j = 0; j <= last; j++)
+        {
+            len += snprintf(buf + len, sizeof(buf) - len, " %lu", (unsigned long)entry->histogram[j]);
+        }
+        logmsg("---- histogram:", buf);
+    }
+
+    if (g_ide_stats.dropped > 0)
+    {
+        logmsg("-- ", (int)g_ide_stats.dropped, " commands not recorded, table full");
+    }
+}
+
+void ide_stats_reset()
+{
+    memset(&g_ide_stats, 0, sizeof(g_ide_stats));
+    logmsg("IDE command statistics cleared");
+}
@@ -0,0 +1,56 @@
+/**
+ * ZuluIDE™ - Copyright (c) 2023 Rabbit Hole Computing™
+ *
+ * ZuluIDE™ firmware is licensed under the GPL version 3 or any later version.
+ *
+ * https://www.gnu.org/licenses/gpl-3.0.html
+ * ----
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Under Section 7 of GPL version 3, you are granted additional
+ * permissions described in the ZuluIDE Hardware Support Library Exception
+ * (GPL-3.0_HSL_Exception.md), as published by Rabbit Hole Computing™.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+// Per-command statistics of ATA and ATAPI commands.
+// Statistics are kept in a fixed-size table indexed by opcode,
+// recording command count, bytes transferred and latency.
+
+#pragma once
+
+#include <stdint.h>
+
+// Number of distinct commands that can be tracked
+#ifndef IDE_STATS_MAX_COMMANDS
+#define IDE_STATS_MAX_COMMANDS 32
+#endif
+
+// Number of log2 latency histogram buckets, last bucket collects all longer commands
+#define IDE_STATS_HISTOGRAM_BUCKETS 20
+
+// Called from ide_protocol_poll() when command execution starts and ends
+void ide_stats_command_start(uint8_t ata_cmd);
+void ide_stats_command_end();
+
+// Called when PACKET command has been received, statistics are then kept by ATAPI opcode
+void ide_stats_set_atapi_command(uint8_t atapi_cmd);
+
+// Called by device handlers for data transferred on IDE bus
+void ide_stats_add_bytes(uint32_t bytes);
+
+// Write statistics table to log
+void ide_stats_log();
+
+// Clear all statistics
+void ide_stats_reset();
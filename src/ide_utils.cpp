@@ -64,4 +64,12 @@ void write_be32(uint8_t *dst, uint32_t value)
     dst[1] = (value >> 16) & 0xFF;
     dst[2] = (value >> 8) & 0xFF;
     dst[3] = (value) & 0xFF;
-}
\ No newline at end of file
+}
+
+uint32_t parse_le32(const uint8_t *src)
+{
+    return ((uint32_t)src[3] << 24) |
+           ((uint32_t)src[2] << 16) |
+           ((uint32_t)src[1] << 8) |
+           ((uint32_t)src[0]);
+}
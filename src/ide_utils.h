@@ -35,4 +35,7 @@ uint32_t parse_be24(const uint8_t *src);
 uint32_t parse_be32(const uint8_t *src);
 void write_be16(uint8_t *dst, uint16_t value);
 void write_be24(uint8_t *dst, uint32_t value);
-void write_be32(uint8_t *dst, uint32_t value);
\ No newline at end of file
+void write_be32(uint8_t *dst, uint32_t value);
+
+// Little-endian fields, used in ISO9660 structures
+uint32_t parse_le32(const uint8_t *src);
\ No newline at end of file
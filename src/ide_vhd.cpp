@@ -0,0 +1,451 @@
+/**
+ * ZuluIDE™ - Copyright (c) 2023 Rabbit Hole Computing™
+ *
+ * ZuluIDE™ firmware is licensed under the GPL version 3 or any later version.
+ *
+ * https://www.gnu.org/licenses/gpl-3.0.html
+ * ----
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Under Section 7 of GPL version 3, you are granted additional
+ * permissions described in the ZuluIDE Hardware Support Library Exception
+ * (GPL-3.0_HSL_Exception.md), as published by Rabbit Hole Computing™.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#include "ide_vhd.h"
+#include "ide_utils.h"
+#include "ZuluIDE.h"
+#include "ZuluIDE_log.h"
+#include <string.h>
+#include <algorithm>
+
+#define VHD_FOOTER_SIZE 512
+#define VHD_DYNAMIC_HEADER_SIZE 1024
+#define VHD_DISK_TYPE_FIXED 2
+#define VHD_DISK_TYPE_DYNAMIC 3
+#define VHD_DISK_TYPE_DIFFERENCING 4
+#define VHD_BLOCK_UNUSED 0xFFFFFFFF
+#define VHD_BAT_ENTRIES_PER_SECTOR 128
+
+// Caches shared by all images, BAT entries are stored in platform byte order
+static struct {
+    uint32_t bat_sector[VHD_BAT_CACHE_SECTORS];
+    uint32_t last_used[VHD_BAT_CACHE_SECTORS];
+    bool valid[VHD_BAT_CACHE_SECTORS];
+    uint32_t counter;
+    uint32_t bat[VHD_BAT_CACHE_SECTORS][VHD_BAT_ENTRIES_PER_SECTOR];
+
+    // Sector bitmap of the most recently accessed block
+    uint32_t bitmap_block;
+    bool bitmap_valid;
+    uint8_t bitmap[VHD_MAX_BLOCK_SIZE / 512 / 8];
+
+    // Footer that is rewritten at the end of file when blocks are added
+    uint8_t footer[VHD_FOOTER_SIZE];
+} g_vhd_cache;
+
+static uint64_t parse_be64(const uint8_t *src)
+{
+    return ((uint64_t)parse_be32(src) << 32) | parse_be32(src + 4);
+}
+
+VHDImage::VHDImage()
+{
+    m_read_only = true;
+    m_disk_size = 0;
+    m_bat_offset = 0;
+    m_bat_entries = 0;
+    m_block_size = 0;
+    m_bitmap_size = 0;
+    m_bitmap_sectors = 0;
+    m_footer_offset = 0;
+    memset(&m_stats, 0, sizeof(m_stats));
+}
+
+bool VHDImage::open(FsFile *folder, const char *filename, bool read_only)
+{
+    close();
+
+    if (!m_file.open(folder, filename, read_only ? O_RDONLY : O_RDWR))
+    {
+        return false;
+    }
+
+    uint64_t file_size = m_file.size();
+    uint8_t *footer = g_vhd_cache.footer;
+    if (file_size < VHD_FOOTER_SIZE + VHD_DYNAMIC_HEADER_SIZE ||
+        !m_file.seek(file_size - VHD_FOOTER_SIZE) ||
+        m_file.read(footer, VHD_FOOTER_SIZE) != VHD_FOOTER_SIZE ||
+        memcmp(footer, "conectix", 8) != 0)
+    {
+        m_file.close();
+        return false;
+    }
+
+    uint32_t disk_type = parse_be32(&footer[60]);
+    if (disk_type != VHD_DISK_TYPE_DYNAMIC)
+    {
+        logmsg("-- VHD disk type ", (int)disk_type, " is not supported, only fixed and dynamic disks are");
+        m_file.close();
+        return false;
+    }
+
+    uint8_t header[40];
+    uint64_t header_offset = parse_be64(&footer[16]);
+    if (!m_file.seek(header_offset) ||
+        m_file.read(header, sizeof(header)) != sizeof(header) ||
+        memcmp(header, "cxsparse", 8) != 0)
+    {
+        logmsg("-- VHD dynamic disk header not found");
+        m_file.close();
+        return false;
+    }
+
+    m_disk_size = parse_be64(&footer[48]);
+    m_bat_offset = parse_be64(&header[16]);
+    m_bat_entries = parse_be32(&header[28]);
+    m_block_size = parse_be32(&header[32]);
+
+    if (m_block_size < 4096 || m_block_size > VHD_MAX_BLOCK_SIZE ||
+        (m_block_size & (m_block_size - 1)) != 0 ||
+        (uint64_t)m_bat_entries * m_block_size < m_disk_size ||
+        (m_disk_size % 512) != 0)
+    {
+        logmsg("-- Unsupported VHD block size ", (int)m_block_size, " or table size ", (int)m_bat_entries);
+        m_file.close();
+        return false;
+    }
+
+    m_bitmap_size = m_block_size / 512 / 8;
+    m_bitmap_sectors = (m_bitmap_size + 511) / 512;
+    m_footer_offset = file_size - VHD_FOOTER_SIZE;
+    m_read_only = read_only;
+    memset(&m_stats, 0, sizeof(m_stats));
+    memset(&g_vhd_cache.valid, 0, sizeof(g_vhd_cache.valid));
+    g_vhd_cache.bitmap_valid = false;
+
+    logmsg("-- Dynamic VHD image, ", (int)(m_disk_size / (1024 * 1024)), " MB in blocks of ",
+           (int)(m_block_size / 1024), " kB, ", (int)((m_footer_offset - m_bat_offset) / (1024 * 1024)),
+           " MB stored");
+    return true;
+}
+
+void VHDImage::close()
+{
+    if (m_file.isOpen())
+    {
+        log_stats();
+        m_file.close();
+    }
+
+    m_disk_size = 0;
+}
+
+bool VHDImage::get_bat_entry(uint32_t block, uint32_t *sector)
+{
+    if (block >= m_bat_entries) return false;
+
+    uint32_t bat_sector = block / VHD_BAT_ENTRIES_PER_SECTOR;
+    uint32_t idx = block % VHD_BAT_ENTRIES_PER_SECTOR;
+
+    // Check cache and find least recently used slot
+    int slot = 0;
+    for (int i = 0; i < VHD_BAT_CACHE_SECTORS; i++)
+    {
+        if (g_vhd_cache.valid[i] && g_vhd_cache.bat_sector[i] == bat_sector)
+        {
+            g_vhd_cache.last_used[i] = ++g_vhd_cache.counter;
+            *sector = g_vhd_cache.bat[i][idx];
+            return true;
+        }
+
+        if (!g_vhd_cache.valid[i] ||
+            (g_vhd_cache.valid[slot] && g_vhd_cache.last_used[i] < g_vhd_cache.last_used[slot]))
+        {
+            slot = i;
+        }
+    }
+    m_stats.bat_misses++;
+
+    // Last BAT sector can be partial
+    uint32_t count = std::min<uint32_t>(VHD_BAT_ENTRIES_PER_SECTOR, m_bat_entries - bat_sector * VHD_BAT_ENTRIES_PER_SECTOR);
+    uint32_t *entries = g_vhd_cache.bat[slot];
+    g_vhd_cache.valid[slot] = false;
+    if (!m_file.seek(m_bat_offset + (uint64_t)bat_sector * 512) ||
+        m_file.read(entries, count * 4) != (int)(count * 4))
+    {
+        logmsg("-- VHD block allocation table read failed at block ", (int)block);
+        return false;
+    }
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        entries[i] = parse_be32((const uint8_t*)&entries[i]);
+    }
+
+    g_vhd_cache.bat_sector[slot] = bat_sector;
+    g_vhd_cache.last_used[slot] = ++g_vhd_cache.counter;
+    g_vhd_cache.valid[slot] = true;
+    *sector = entries[idx];
+    return true;
+}
+
+bool VHDImage::set_bat_entry(uint32_t block, uint32_t sector)
+{
+    uint8_t entry[4];
+    write_be32(entry, sector);
+    if (!m_file.seek(m_bat_offset + (uint64_t)block * 4) ||
+        m_file.write(entry, 4) != 4)
+    {
+        return false;
+    }
+
+    uint32_t bat_sector = block / VHD_BAT_ENTRIES_PER_SECTOR;
+    for (int i = 0; i < VHD_BAT_CACHE_SECTORS; i++)
+    {
+        if (g_vhd_cache.valid[i] && g_vhd_cache.bat_sector[i] == bat_sector)
+        {
+            g_vhd_cache.bat[i][block % VHD_BAT_ENTRIES_PER_SECTOR] = sector;
+        }
+    }
+    return true;
+}
+
+const uint8_t *VHDImage::get_bitmap(uint32_t block, uint32_t sector)
+{
+    if (g_vhd_cache.bitmap_valid && g_vhd_cache.bitmap_block == block)
+    {
+        return g_vhd_cache.bitmap;
+    }
+
+    g_vhd_cache.bitmap_valid = false;
+    if (!m_file.seek((uint64_t)sector * 512) ||
+        m_file.read(g_vhd_cache.bitmap, m_bitmap_size) != (int)m_bitmap_size)
+    {
+        logmsg("-- VHD sector bitmap read failed for block ", (int)block);
+        return nullptr;
+    }
+
+    g_vhd_cache.bitmap_block = block;
+    g_vhd_cache.bitmap_valid = true;
+    return g_vhd_cache.bitmap;
+}
+
+static bool bitmap_get(const uint8_t *bitmap, uint32_t idx)
+{
+    return bitmap[idx / 8] & (0x80 >> (idx % 8));
+}
+
+bool VHDImage::read(uint64_t pos, uint8_t *dest, size_t len)
+{
+    if (!is_open() || ((pos | len) & 511) != 0 || pos + len > m_disk_size) return false;
+
+    m_stats.bytes_read += len;
+    while (len > 0)
+    {
+        uint32_t block = pos / m_block_size;
+        uint32_t offset = pos % m_block_size;
+        size_t count = std::min<size_t>(len, m_block_size - offset);
+
+        uint32_t sector;
+        if (!get_bat_entry(block, &sector)) return false;
+
+        if (sector == VHD_BLOCK_UNUSED)
+        {
+            // Block has never been written
+            memset(dest, 0, count);
+            m_stats.bytes_zero += count;
+        }
+        else
+        {
+            const uint8_t *bitmap = get_bitmap(block, sector);
+            if (!bitmap) return false;
+
+            // Read runs of sectors that are either all stored or all unused
+            uint64_t data_start = ((uint64_t)sector + m_bitmap_sectors) * 512;
+            uint32_t idx = offset / 512;
+            uint32_t end = (offset + count) / 512;
+            uint8_t *p = dest;
+            while (idx < end)
+            {
+                bool stored = bitmap_get(bitmap, idx);
+                uint32_t run = 1;
+                while (idx + run < end && bitmap_get(bitmap, idx + run) == stored) run++;
+
+                if (stored)
+                {
+                    if (!m_file.seek(data_start + (uint64_t)idx * 512) ||
+                        m_file.read(p, run * 512) != (int)(run * 512))
+                    {
+                        return false;
+                    }
+                }
+                else
+                {
+                    memset(p, 0, run * 512);
+                    m_stats.bytes_zero += run * 512;
+                }
+
+                p += run * 512;
+                idx += run;
+            }
+        }
+
+        dest += count;
+        pos += count;
+        len -= count;
+    }
+
+    return true;
+}
+
+bool VHDImage::allocate(uint64_t pos, size_t len, uint8_t *scratch, size_t scratch_size)
+{
+    if (!is_open() || m_read_only || pos + len > m_disk_size) return false;
+    if (len == 0) return true;
+
+    uint32_t first = pos / m_block_size;
+    uint32_t last = (pos + len - 1) / m_block_size;
+    for (uint32_t block = first; block <= last; block++)
+    {
+        uint32_t sector;
+        if (!get_bat_entry(block, &sector)) return false;
+        if (sector == VHD_BLOCK_UNUSED && !allocate_block(block, scratch, scratch_size))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool VHDImage::allocate_block(uint32_t block, uint8_t *scratch, size_t scratch_size)
+{
+    // New block starts where the footer is now, with an all-zero sector bitmap.
+    // No sector is marked as stored, and write() sets the bits as sectors are written.
+    uint32_t sector = m_footer_offset / 512;
+    uint32_t bitmap_bytes = m_bitmap_sectors * 512;
+    uint64_t footer_offset = m_footer_offset + bitmap_bytes + m_block_size;
+    scratch_size &= ~511;
+    if (scratch_size < bitmap_bytes) return false;
+
+    // The file can only be extended by writing to it, so the space is appended
+    // after the current footer, followed by the footer at its new position.
+    // Until the flush completes the old file size and footer remain valid.
+    // The space is zeroed so that no earlier transfer buffer contents end up in the file.
+    if (!m_file.seek(m_footer_offset + VHD_FOOTER_SIZE)) return false;
+    uint64_t remain = footer_offset - (m_footer_offset + VHD_FOOTER_SIZE);
+    memset(scratch, 0, std::min<uint64_t>(remain, scratch_size));
+    while (remain > 0)
+    {
+        platform_reset_watchdog();
+        uint32_t count = std::min<uint64_t>(remain, scratch_size);
+        if (m_file.write(scratch, count) != count) return false;
+        remain -= count;
+    }
+
+    if (m_file.write(g_vhd_cache.footer, VHD_FOOTER_SIZE) != VHD_FOOTER_SIZE ||
+        !m_file.flush())
+    {
+        logmsg("-- VHD file extension failed for block ", (int)block);
+        return false;
+    }
+
+    // The old footer becomes the first bitmap sector, and the block is
+    // referenced from the BAT only after its bitmap has been written.
+    if (!m_file.seek(m_footer_offset) ||
+        m_file.write(scratch, 512) != 512 ||
+        !set_bat_entry(block, sector) ||
+        !m_file.flush())
+    {
+        logmsg("-- VHD block allocation failed for block ", (int)block);
+        return false;
+    }
+
+    m_footer_offset = footer_offset;
+    m_stats.blocks_allocated++;
+
+    memset(g_vhd_cache.bitmap, 0, sizeof(g_vhd_cache.bitmap));
+    g_vhd_cache.bitmap_block = block;
+    g_vhd_cache.bitmap_valid = true;
+    return true;
+}
+
+bool VHDImage::write(uint64_t pos, const uint8_t *src, size_t len)
+{
+    if (!is_open() || m_read_only || ((pos | len) & 511) != 0 || pos + len > m_disk_size) return false;
+
+    m_stats.bytes_written += len;
+    while (len > 0)
+    {
+        uint32_t block = pos / m_block_size;
+        uint32_t offset = pos % m_block_size;
+        size_t count = std::min<size_t>(len, m_block_size - offset);
+
+        uint32_t sector;
+        if (!get_bat_entry(block, &sector) || sector == VHD_BLOCK_UNUSED) return false;
+
+        uint64_t data_start = ((uint64_t)sector + m_bitmap_sectors) * 512;
+        if (!m_file.seek(data_start + offset) ||
+            m_file.write(src, count) != count)
+        {
+            return false;
+        }
+
+        // Mark the written sectors as stored
+        const uint8_t *bitmap = get_bitmap(block, sector);
+        if (!bitmap) return false;
+
+        uint32_t first = offset / 512;
+        uint32_t end = (offset + count) / 512;
+        bool changed = false;
+        for (uint32_t idx = first; idx < end; idx++)
+        {
+            if (!bitmap_get(bitmap, idx))
+            {
+                g_vhd_cache.bitmap[idx / 8] |= (0x80 >> (idx % 8));
+                changed = true;
+            }
+        }
+
+        if (changed)
+        {
+            uint32_t first_byte = first / 8;
+            uint32_t bytes = (end - 1) / 8 - first_byte + 1;
+            if (!m_file.seek((uint64_t)sector * 512 + first_byte) ||
+                m_file.write(g_vhd_cache.bitmap + first_byte, bytes) != bytes)
+            {
+                g_vhd_cache.bitmap_valid = false;
+                return false;
+            }
+        }
+
+        src += count;
+        pos += count;
+        len -= count;
+    }
+
+    return true;
+}
+
+void VHDImage::log_stats()
+{
+    if (m_stats.bytes_read == 0 && m_stats.bytes_written == 0) return;
+
+    logmsg("Dynamic VHD image: ", (int)(m_stats.bytes_read / 1024), " kB read, of which ",
+           (int)(m_stats.bytes_zero / 1024), " kB unallocated, ",
+           (int)(m_stats.bytes_written / 1024), " kB written, ",
+           (int)m_stats.blocks_allocated, " blocks allocated, ",
+           (int)m_stats.bat_misses, " allocation table cache misses");
+}
@@ -0,0 +1,104 @@
+/**
+ * ZuluIDE™ - Copyright (c) 2023 Rabbit Hole Computing™
+ *
+ * ZuluIDE™ firmware is licensed under the GPL version 3 or any later version.
+ *
+ * https://www.gnu.org/licenses/gpl-3.0.html
+ * ----
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Under Section 7 of GPL version 3, you are granted additional
+ * permissions described in the ZuluIDE Hardware Support Library Exception
+ * (GPL-3.0_HSL_Exception.md), as published by Rabbit Hole Computing™.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+// Support for dynamic (sparse) VHD hard disk images.
+// The disk is divided into blocks, typically 2 MB, which are stored in the file
+// only after they have been written to. The block allocation table (BAT) gives
+// the file location of each block, and each stored block starts with a bitmap
+// of which of its sectors contain data. Other sectors read as zeros.
+// New blocks are appended to the end of the file, followed by the VHD footer.
+
+#pragma once
+
+#include <stdint.h>
+#include <SdFat.h>
+
+// Largest supported block size, limited by the size of the cached sector bitmap
+#ifndef VHD_MAX_BLOCK_SIZE
+#define VHD_MAX_BLOCK_SIZE (2 * 1024 * 1024)
+#endif
+
+// Number of BAT sectors kept in RAM, each has entries for 128 blocks
+#ifndef VHD_BAT_CACHE_SECTORS
+#define VHD_BAT_CACHE_SECTORS 4
+#endif
+
+// The BAT and bitmap caches are shared, so only one image
+// should be open at a time.
+class VHDImage
+{
+public:
+    VHDImage();
+
+    // Open the file and check that it is a dynamic VHD image.
+    // Returns false if the file is not a supported dynamic VHD.
+    bool open(FsFile *folder, const char *filename, bool read_only);
+    void close();
+    bool is_open() { return m_file.isOpen(); }
+    FsFile *file() { return &m_file; }
+
+    // Size of the virtual disk
+    uint64_t size() { return m_disk_size; }
+
+    // Position and length must be multiples of 512 bytes
+    bool read(uint64_t pos, uint8_t *dest, size_t len);
+    bool write(uint64_t pos, const uint8_t *src, size_t len);
+
+    // Allocate any blocks that are not yet stored for the given range.
+    // This must be done before write(). The file is extended by writing
+    // the scratch buffer, which is overwritten. Sectors of new blocks are
+    // marked as stored only when write() stores data to them.
+    bool allocate(uint64_t pos, size_t len, uint8_t *scratch, size_t scratch_size);
+
+    void log_stats();
+
+protected:
+    FsFile m_file;
+    bool m_read_only;
+    uint64_t m_disk_size;
+    uint64_t m_bat_offset;
+    uint32_t m_bat_entries;
+    uint32_t m_block_size;
+    uint32_t m_bitmap_size; // Bytes of sector bitmap in use
+    uint32_t m_bitmap_sectors; // Sectors reserved for bitmap before block data
+    uint64_t m_footer_offset; // Footer is moved forward when blocks are added
+
+    struct {
+        uint64_t bytes_read;
+        uint64_t bytes_zero; // Read bytes that were not stored in the file
+        uint64_t bytes_written;
+        uint32_t blocks_allocated;
+        uint32_t bat_misses;
+    } m_stats;
+
+    // Get the sector in file where block starts, or VHD_BLOCK_UNUSED
+    bool get_bat_entry(uint32_t block, uint32_t *sector);
+    bool set_bat_entry(uint32_t block, uint32_t sector);
+
+    // Get sector bitmap of a stored block
+    const uint8_t *get_bitmap(uint32_t block, uint32_t sector);
+
+    bool allocate_block(uint32_t block, uint8_t *scratch, size_t scratch_size);
+};
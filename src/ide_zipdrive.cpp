@@ -25,6 +25,7 @@
 
 #include "ide_zipdrive.h"
 #include "ide_utils.h"
+#include "ide_stats.h"
 #include "atapi_constants.h"
 #include "ZuluIDE_log.h"
 #include "ZuluIDE_config.h"
@@ -298,6 +299,7 @@ bool IDEZipDrive::cmd_identify_packet_device(ide_registers_t *regs)
     ide_phy_set_regs(regs);
     ide_phy_start_write(sizeof(idf));
     ide_phy_write_block((uint8_t*)idf, sizeof(idf));
+    ide_stats_add_bytes(sizeof(idf));
 
     uint32_t start = millis();
     while (!ide_phy_is_write_finished())
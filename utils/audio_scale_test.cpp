@@ -0,0 +1,151 @@
+// Host-side check and benchmark of CD audio volume scaling in lib/ZuluIDE_Audio_RP2MCU/audio_scale.h.
+// Every sample value is checked at every volume and max_volume combination against the
+// original snd_encode() formula, which used a 64-bit multiply and division per sample.
+// Build with: g++ -O2 -Wall -I../lib/ZuluIDE_Audio_RP2MCU -o audio_scale_test audio_scale_test.cpp
+// Usage: ./audio_scale_test
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "audio_scale.h"
+
+#define BENCHMARK_WORDS (2352 / 4)
+#define BENCHMARK_ROUNDS 20000
+
+// Original implementation, output_buf and samples point to the same buffer
+static void reference_encode(int16_t *samples, int16_t *output_buf, uint32_t len, uint8_t vol_l, uint8_t vol_r, uint8_t max_volume)
+{
+    uint8_t vol[2] = {vol_l, vol_r};
+    int16_t temp = 0;
+    for (uint32_t i = 0; i < len; i++)
+    {
+        if (i % 2 == 0)
+        {
+            temp = output_buf[i+1];
+            output_buf[i+1] = (int16_t)(((int64_t)samples[i]) * (vol[0]) * max_volume / 25500);
+        }
+        else
+        {
+            output_buf[i-1] = (int16_t)(((int64_t)temp) * (vol[1]) * max_volume / 25500);
+        }
+    }
+}
+
+static double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// All sample values against every scale that volume and max_volume can produce
+static int check_samples()
+{
+    static bool checked[255 * 255 + 1];
+    uint32_t scales = 0, failures = 0;
+
+    for (uint32_t vol = 0; vol <= 255; vol++)
+    {
+        for (uint32_t max_volume = 0; max_volume <= 255; max_volume++)
+        {
+            uint32_t scale = vol * max_volume;
+            if (checked[scale]) continue;
+            checked[scale] = true;
+            scales++;
+
+            for (int32_t s = -32768; s <= 32767; s++)
+            {
+                uint16_t expected = (uint16_t)(int16_t)(((int64_t)s) * vol * max_volume / 25500);
+                uint16_t result = audio_scale_sample((int16_t)s, scale);
+                if (result != expected)
+                {
+                    if (failures < 10)
+                    {
+                        printf("FAIL: sample %d volume %u max_volume %u: got %d, expected %d\n",
+                               (int)s, (unsigned)vol, (unsigned)max_volume, (int16_t)result, (int16_t)expected);
+                    }
+                    failures++;
+                }
+            }
+        }
+    }
+
+    printf("Sample check: %u scales x 65536 samples, %u mismatches\n", (unsigned)scales, (unsigned)failures);
+    return failures ? 1 : 0;
+}
+
+// Whole buffers including channel order, mute and unity paths
+static int check_buffers()
+{
+    static const uint8_t volumes[][3] = {
+        {255, 255, 100}, {0, 0, 100}, {255, 0, 100}, {0, 255, 100},
+        {128, 200, 100}, {255, 255, 50}, {1, 254, 99}, {255, 255, 0},
+    };
+
+    uint32_t words[BENCHMARK_WORDS];
+    int16_t expected[BENCHMARK_WORDS * 2];
+    uint32_t seed = 1;
+    int failures = 0;
+
+    for (size_t v = 0; v < sizeof(volumes) / sizeof(volumes[0]); v++)
+    {
+        for (int i = 0; i < BENCHMARK_WORDS; i++)
+        {
+            seed = seed * 1103515245 + 12345;
+            words[i] = seed ^ (seed >> 7);
+        }
+        memcpy(expected, words, sizeof(words));
+
+        reference_encode(expected, expected, BENCHMARK_WORDS * 2, volumes[v][0], volumes[v][1], volumes[v][2]);
+        audio_scale_words(words, BENCHMARK_WORDS, volumes[v][0] * volumes[v][2], volumes[v][1] * volumes[v][2]);
+
+        if (memcmp(words, expected, sizeof(words)) != 0)
+        {
+            printf("FAIL: buffer differs at volume %d/%d max_volume %d\n", volumes[v][0], volumes[v][1], volumes[v][2]);
+            failures++;
+        }
+    }
+
+    printf("Buffer check: %s\n", failures ? "FAILED" : "OK");
+    return failures;
+}
+
+static void benchmark()
+{
+    static uint32_t words[BENCHMARK_WORDS];
+    for (int i = 0; i < BENCHMARK_WORDS; i++) words[i] = i * 2654435761u;
+
+    double start = now_seconds();
+    for (int i = 0; i < BENCHMARK_ROUNDS; i++)
+    {
+        reference_encode((int16_t*)words, (int16_t*)words, BENCHMARK_WORDS * 2, 200, 180, 100);
+    }
+    double reference_time = now_seconds() - start;
+
+    start = now_seconds();
+    for (int i = 0; i < BENCHMARK_ROUNDS; i++)
+    {
+        audio_scale_words(words, BENCHMARK_WORDS, 200 * 100, 180 * 100);
+    }
+    double scale_time = now_seconds() - start;
+
+    start = now_seconds();
+    for (int i = 0; i < BENCHMARK_ROUNDS; i++)
+    {
+        audio_scale_words(words, BENCHMARK_WORDS, AUDIO_SCALE_UNITY, AUDIO_SCALE_UNITY);
+    }
+    double unity_time = now_seconds() - start;
+
+    double sectors = BENCHMARK_ROUNDS;
+    printf("Benchmark per 2352-byte sector: original %.1f ns, reciprocal %.1f ns, unity %.1f ns\n",
+           reference_time / sectors * 1e9, scale_time / sectors * 1e9, unity_time / sectors * 1e9);
+}
+
+int main()
+{
+    int failures = check_samples();
+    failures += check_buffers();
+    benchmark();
+    return failures ? 1 : 0;
+}